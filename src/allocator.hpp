@@ -0,0 +1,173 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <thread>
+using namespace std;
+
+#define SLAB_SIZE (1 << 16)             // slabs are aligned to their size, so a block finds its slab by masking
+#define SLAB_GRANULE 16
+#define SLAB_MAX_BLOCK_SIZE 512         // larger blocks go to malloc
+#define SLAB_NUM_SIZE_CLASSES (SLAB_MAX_BLOCK_SIZE / SLAB_GRANULE)
+#define SLAB_LOCK_SPINS_BEFORE_YIELD 64
+
+// slab allocator with per-size free lists for nodes and small arrays
+// memory is carved from large aligned slabs and recycled through the free lists until the allocator is destroyed
+// define VPYLM_NO_SLAB_ALLOCATOR to fall back to malloc/free
+class SlabAllocator {
+private:
+    struct Slab {
+        SlabAllocator *owner;
+        Slab *next;
+    };
+    struct FreeBlock {
+        FreeBlock *next;
+    };
+    FreeBlock *_free_lists[SLAB_NUM_SIZE_CLASSES];
+    Slab *_slabs;
+    char *_cursor;
+    char *_end;
+    std::atomic_flag _lock = ATOMIC_FLAG_INIT;
+
+    static int size_class(size_t size) {
+        return (size + SLAB_GRANULE - 1) / SLAB_GRANULE - 1;
+    }
+    void lock() {
+        int spins = 0;
+        while (_lock.test_and_set(std::memory_order_acquire)) {
+            // hogwild threads share the allocator of the tree, and the holder may be preempted when there are more
+            // threads than cores, as with node locks
+            if (++spins % SLAB_LOCK_SPINS_BEFORE_YIELD == 0) {
+                std::this_thread::yield();
+            }
+        }
+    }
+    void unlock() {
+        _lock.clear(std::memory_order_release);
+    }
+    void add_slab() {
+        void *memory = NULL;
+        if (posix_memalign(&memory, SLAB_SIZE, SLAB_SIZE) != 0) {
+            throw std::bad_alloc();
+        }
+        Slab *slab = (Slab*)memory;
+        slab->owner = this;
+        slab->next = _slabs;
+        _slabs = slab;
+        _num_slabs++;
+        _cursor = (char*)memory + SLAB_GRANULE * ((sizeof(Slab) + SLAB_GRANULE - 1) / SLAB_GRANULE);
+        _end = (char*)memory + SLAB_SIZE;
+    }
+public:
+    int _num_slabs;
+    SlabAllocator() {
+        for (int k=0; k<SLAB_NUM_SIZE_CLASSES; ++k) {
+            _free_lists[k] = NULL;
+        }
+        _slabs = NULL;
+        _cursor = NULL;
+        _end = NULL;
+        _num_slabs = 0;
+    }
+    SlabAllocator(const SlabAllocator &) = delete;
+    SlabAllocator &operator=(const SlabAllocator &) = delete;
+    ~SlabAllocator() {
+        while (_slabs) {
+            Slab *next = _slabs->next;
+            free(_slabs);
+            _slabs = next;
+        }
+    }
+    void *allocate_block(size_t size) {
+        int k = size_class(size);
+        lock();
+        FreeBlock *block = _free_lists[k];
+        if (block) {
+            _free_lists[k] = block->next;
+            unlock();
+            return block;
+        }
+        size_t block_size = (k + 1) * SLAB_GRANULE;
+        if (_cursor == NULL || _cursor + block_size > _end) {
+            add_slab();
+        }
+        void *ptr = _cursor;
+        _cursor += block_size;
+        unlock();
+        return ptr;
+    }
+    void release_block(void *ptr, size_t size) {
+        int k = size_class(size);
+        FreeBlock *block = (FreeBlock*)ptr;
+        lock();
+        block->next = _free_lists[k];
+        _free_lists[k] = block;
+        unlock();
+    }
+    size_t get_num_bytes_reserved() {
+        return (size_t)_num_slabs * SLAB_SIZE;
+    }
+    // allocator of the current thread; set with `Scope`, otherwise a process-wide one
+    static SlabAllocator *&current() {
+        static thread_local SlabAllocator *allocator = NULL;
+        return allocator;
+    }
+    static SlabAllocator *shared() {
+        static SlabAllocator *allocator = new SlabAllocator();
+        return allocator;
+    }
+    static void *allocate(size_t size) {
+#ifndef VPYLM_NO_SLAB_ALLOCATOR
+        if (size > 0 && size <= SLAB_MAX_BLOCK_SIZE) {
+            SlabAllocator *allocator = current();
+            if (allocator == NULL) {
+                allocator = shared();
+            }
+            return allocator->allocate_block(size);
+        }
+#endif
+        void *ptr = malloc(size);
+        if (ptr == NULL) {
+            throw std::bad_alloc();
+        }
+        return ptr;
+    }
+    // `size` must be the one passed to `allocate`
+    static void deallocate(void *ptr, size_t size) {
+        if (ptr == NULL) {
+            return;
+        }
+#ifndef VPYLM_NO_SLAB_ALLOCATOR
+        if (size > 0 && size <= SLAB_MAX_BLOCK_SIZE) {
+            Slab *slab = (Slab*)((uintptr_t)ptr & ~(uintptr_t)(SLAB_SIZE - 1));
+            slab->owner->release_block(ptr, size);
+            return;
+        }
+#endif
+        free(ptr);
+    }
+    // routes allocations of this thread to `allocator` while alive
+    class Scope {
+    private:
+        SlabAllocator *_prev;
+    public:
+        Scope(SlabAllocator *allocator) {
+            _prev = current();
+            current() = allocator;
+        }
+        ~Scope() {
+            current() = _prev;
+        }
+    };
+};
+
+// allocation policy for emilib::HashMap and SmallVector
+struct SlabAllocation {
+    static void *allocate(size_t size) {
+        return SlabAllocator::allocate(size);
+    }
+    static void deallocate(void *ptr, size_t size) {
+        SlabAllocator::deallocate(ptr, size);
+    }
+};
@@ -0,0 +1,76 @@
+#pragma once
+#include <algorithm>
+#include <numeric>
+#include <vector>
+#include "common.hpp"
+#include "scoring_state.hpp"
+using namespace std;
+
+// scores many sequences sharing prefixes, such as n-best hypotheses, computing every (prefix, token) pair once
+// sequences are visited in lexicographic order, in which each shares with the one before it the longest prefix it
+// shares with any earlier one, so only the tokens past that prefix are scored; the states and partial sums along the
+// previous sequence are the path of a prefix trie walked depth first
+template<typename IdT>
+class BasicBatchScorer {
+private:
+    vector<int> _order;
+    vector<BasicScoringState<IdT>> _states;     // `_states[t]`: context after token t of the previous sequence
+    vector<double> _prefix_log_Pw;              // log P of its tokens 1 to t
+    long _num_evaluations;                      // tokens scored so far
+public:
+    BasicBatchScorer() {
+        _num_evaluations = 0;
+    }
+    // log P of every sequence, each beginning with ID_BOS like the datasets, with the same sums as `compute_log_Pw`
+    // `score(state, token_id, next_state)` gives log Pw and the extended state, as `BasicVPYLM::score` does
+    template<typename ScoreT>
+    void score(const vector<vector<IdT>> &sequences, const ScoreT &score, vector<double> &log_Pw) {
+        log_Pw.assign(sequences.size(), 0);
+        _order.resize(sequences.size());
+        std::iota(_order.begin(), _order.end(), 0);
+        std::sort(_order.begin(), _order.end(), [&](int a, int b) {
+            return sequences[a] < sequences[b];
+        });
+        size_t max_size = 0;
+        for (auto &token_ids : sequences) {
+            max_size = std::max(max_size, token_ids.size());
+        }
+        if (_states.size() < max_size) {
+            _states.resize(max_size);
+            _prefix_log_Pw.resize(max_size);
+        }
+        const vector<IdT> *prev_token_ids = NULL;
+        for (int index : _order) {
+            const vector<IdT> &token_ids = sequences[index];
+            if (token_ids.size() == 0) {
+                continue;
+            }
+            int num_shared = 0;
+            if (prev_token_ids != NULL) {
+                while (num_shared < token_ids.size() && num_shared < prev_token_ids->size() && token_ids[num_shared] == (*prev_token_ids)[num_shared]) {
+                    num_shared++;
+                }
+            }
+            if (num_shared == 0) {
+                _states[0] = BasicScoringState<IdT>();
+                _states[0].extend(_states[0], token_ids[0]);
+                _prefix_log_Pw[0] = 0;
+                num_shared = 1;
+            }
+            for (int t=num_shared; t<token_ids.size(); ++t) {
+                _prefix_log_Pw[t] = _prefix_log_Pw[t - 1] + score(_states[t - 1], token_ids[t], _states[t]);
+                _num_evaluations++;
+            }
+            log_Pw[index] = _prefix_log_Pw[token_ids.size() - 1];
+            prev_token_ids = &token_ids;
+        }
+    }
+    long get_num_evaluations() const {
+        return _num_evaluations;
+    }
+    void clear_num_evaluations() {
+        _num_evaluations = 0;
+    }
+};
+
+using BatchScorer = BasicBatchScorer<id>;
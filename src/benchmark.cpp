@@ -0,0 +1,672 @@
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include "model.cpp"
+using namespace std;
+
+double elapsed_seconds(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// resident set size of this process
+long rss_kilobytes() {
+    std::ifstream ifs("/proc/self/status");
+    string line;
+    while (getline(ifs, line)) {
+        if (line.compare(0, 6, "VmRSS:") == 0) {
+            return stol(line.substr(6));
+        }
+    }
+    return 0;
+}
+
+PyVPYLM *load_model(string filename) {
+    PyVPYLM *model = new PyVPYLM();
+    model->set_seed(0);
+    model->load_textfile(filename, 0.9);
+    model->set_g0(1.0 / model->get_num_types_of_words());
+    model->prepare();
+    return model;
+}
+
+// `load_model` after `num_epochs` sweeps, each followed by resampling the hyperparameters unless told otherwise
+PyVPYLM *train_model(string filename, int num_epochs, bool sample_hyperparams=true) {
+    PyVPYLM *model = load_model(filename);
+    for (int epoch=1; epoch<=num_epochs; ++epoch) {
+        model->perform_gibbs_sampling();
+        if (sample_hyperparams) {
+            model->sample_hyperparams();
+        }
+    }
+    return model;
+}
+
+// tokens predicted in `dataset`, every one but the first of each sentence
+long count_tokens(vector<vector<id>> &dataset) {
+    long num_tokens = 0;
+    for (auto &token_ids : dataset) {
+        num_tokens += token_ids.size() - 1;
+    }
+    return num_tokens;
+}
+
+// tokens/sec of `perform_gibbs_sampling`
+void benchmark_gibbs_sampling(string filename, int num_epochs) {
+    PyVPYLM *model = load_model(filename);
+    long num_tokens = count_tokens(model->_dataset_train);
+    auto start = chrono::steady_clock::now();
+    for (int epoch=1; epoch<=num_epochs; ++epoch) {
+        model->perform_gibbs_sampling();
+    }
+    double sec = elapsed_seconds(start);
+    cout << "[gibbs] " << filename << ": " << num_epochs << " epochs, " << sec << " sec, ";
+    cout << (double)num_tokens * num_epochs / sec << " tokens/sec, ";
+    cout << "depth " << model->get_vpylm_depth() << ", ppl " << model->compute_perplexity_test() << endl;
+    delete model;
+}
+
+// tokens/sec and held-out ppl of parallel sweeps for 1, 2, 4, ... threads, and the time threads spent idle
+// hogwild sweeps also report how often a node lock was held by another thread
+void benchmark_parallel_gibbs_sampling(string filename, int num_epochs, bool hogwild) {
+    string name = hogwild ? "[hogwild gibbs] " : "[parallel gibbs] ";
+    int max_threads = std::max(2, (int)thread::hardware_concurrency());
+    for (int num_threads=1; num_threads<=max_threads; num_threads*=2) {
+        sampler::set_seed(0);
+        PyVPYLM *model = load_model(filename);
+        model->set_num_threads(num_threads);
+        model->set_hogwild(hogwild);
+        long num_tokens = count_tokens(model->_dataset_train);
+        auto start = chrono::steady_clock::now();
+        for (int epoch=1; epoch<=num_epochs; ++epoch) {
+            model->perform_gibbs_sampling();
+        }
+        double sec = elapsed_seconds(start);
+        // taken before the test data is scored on the same threads
+        double busy_sec = 0;
+        double idle_sec = 0;
+        long num_stolen_batches = 0;
+        for (auto &stats : model->_scheduler->get_stats()) {
+            busy_sec += stats.busy_sec;
+            idle_sec += stats.idle_sec;
+            num_stolen_batches += stats.num_stolen_batches;
+        }
+        cout << name << num_threads << " threads: " << num_epochs << " epochs, " << sec << " sec, ";
+        cout << (double)num_tokens * num_epochs / sec << " tokens/sec, ";
+        cout << "depth " << model->get_vpylm_depth() << ", ppl " << model->compute_perplexity_test();
+        if (num_threads > 1) {
+            cout << ", busy " << busy_sec << " sec, idle " << idle_sec << " sec, " << num_stolen_batches << " batches stolen";
+            // the time no batch runs, which more threads cannot shorten, as a share of the work of one thread
+            double serial_sec = std::max(0.0, sec - (busy_sec + idle_sec) / num_threads);
+            double serial_share = serial_sec / (serial_sec + busy_sec);
+            cout << ", serial " << serial_share * 100 << "%, speedup at most " << 1 / serial_share;
+        }
+        if (num_threads > 1 && hogwild) {
+            ContentionStats &stats = model->_contention_stats;
+            cout << ", " << stats.num_locks << " locks, " << stats.num_contended_locks << " contended, ";
+            cout << stats.num_missing_customers << " missing customers, ";
+            cout << stats.num_buffered_counts << " pass counts buffered in " << stats.num_flushes << " flushes";
+        }
+        cout << endl;
+        delete model;
+    }
+}
+// sec and held-out ppl of the ensemble of 1, 2, 4 independent chains, with as many threads as chains
+void benchmark_chains(string filename, int num_epochs) {
+    for (int num_chains=1; num_chains<=4; num_chains*=2) {
+        sampler::set_seed(0);
+        PyVPYLM *model = load_model(filename);
+        model->set_num_chains(num_chains);
+        model->set_num_threads(num_chains);
+        auto start = chrono::steady_clock::now();
+        for (int epoch=1; epoch<=num_epochs; ++epoch) {
+            model->perform_gibbs_sampling();
+            model->sample_hyperparams();
+        }
+        double sec = elapsed_seconds(start);
+        cout << "[chains] " << num_chains << " chains: " << num_epochs << " epochs, " << sec << " sec, ";
+        cout << "ppl " << model->compute_perplexity_test() << endl;
+        delete model;
+    }
+}
+// tokens/sec of `sample_depth_at_timestep` on a trained tree
+void benchmark_sample_depth(string filename, int num_epochs, int num_repeats) {
+    PyVPYLM *model = train_model(filename, num_epochs, false);
+    int num_tokens = 0;
+    long long sum_depth = 0;
+    auto start = chrono::steady_clock::now();
+    for (int repeat=0; repeat<num_repeats; ++repeat) {
+        for (auto &token_ids : model->_dataset_train) {
+            for (int token_t_index=1; token_t_index<token_ids.size(); ++token_t_index) {
+                sum_depth += model->_vpylm->sample_depth_at_timestep(token_ids, token_t_index);
+                num_tokens++;
+            }
+        }
+    }
+    double sec = elapsed_seconds(start);
+    cout << "[sample_depth] " << filename << ": " << sec << " sec, ";
+    cout << num_tokens / sec << " tokens/sec, mean depth " << (double)sum_depth / num_tokens << endl;
+    delete model;
+}
+
+// lookups/sec of `find_node_by_tracing_back_context` down to the deepest existing node of each context
+void benchmark_find_node(string filename, int num_epochs, int num_repeats) {
+    PyVPYLM *model = train_model(filename, num_epochs, false);
+    VPYLM *vpylm = model->_vpylm;
+    int max_depth = vpylm->get_depth();
+    int num_lookups = 0;
+    long long sum_depth = 0;
+    auto start = chrono::steady_clock::now();
+    for (int repeat=0; repeat<num_repeats; ++repeat) {
+        for (auto &token_ids : model->_dataset_train) {
+            for (int token_t_index=1; token_t_index<token_ids.size(); ++token_t_index) {
+                int depth = std::min(token_t_index, max_depth);
+                Node *node = vpylm->find_node_by_tracing_back_context(token_ids, token_t_index, depth, false, true);
+                sum_depth += node->_depth;
+                num_lookups++;
+            }
+        }
+    }
+    double sec = elapsed_seconds(start);
+    cout << "[find_node] " << filename << ": " << num_lookups / sec << " lookups/sec, mean depth " << (double)sum_depth / num_lookups << endl;
+    delete model;
+}
+
+// sec per call of sample_hyperparams for 1, 2, 4, ... threads; d_m and theta_m are the same for all of them
+void benchmark_sample_hyperparams(string filename, int num_epochs, int num_repeats) {
+    PyVPYLM *model = train_model(filename, num_epochs, false);
+    int max_threads = std::max(2, (int)thread::hardware_concurrency());
+    for (int num_threads=1; num_threads<=max_threads; num_threads*=2) {
+        model->set_num_threads(num_threads);
+        vector<double> d_m = model->_vpylm->_d_m;
+        vector<double> theta_m = model->_vpylm->_theta_m;
+        sampler::set_seed(0);
+        auto start = chrono::steady_clock::now();
+        for (int repeat=0; repeat<num_repeats; ++repeat) {
+            model->sample_hyperparams();
+        }
+        double sec = elapsed_seconds(start);
+        cout << "[sample_hyperparams] " << num_threads << " threads: " << sec / num_repeats << " sec/call, ";
+        cout << model->get_num_nodes() << " nodes, d_0 " << model->_vpylm->_d_m[0] << ", theta_0 " << model->_vpylm->_theta_m[0] << endl;
+        model->_vpylm->_d_m = d_m;
+        model->_vpylm->_theta_m = theta_m;
+    }
+    delete model;
+}
+// sentences/sec of `compute_log_Pdataset_train` for 1, 2, 4, ... threads; log_Pdataset is the same for all of them
+void benchmark_evaluation(string filename, int num_epochs, int num_repeats) {
+    PyVPYLM *model = train_model(filename, num_epochs, false);
+    int max_threads = std::max(2, (int)thread::hardware_concurrency());
+    for (int num_threads=1; num_threads<=max_threads; num_threads*=2) {
+        model->set_num_threads(num_threads);
+        double log_Pdataset = 0;
+        auto start = chrono::steady_clock::now();
+        for (int repeat=0; repeat<num_repeats; ++repeat) {
+            log_Pdataset = model->compute_log_Pdataset_train();
+        }
+        double sec = elapsed_seconds(start);
+        cout << "[evaluation] " << num_threads << " threads: " << sec << " sec, ";
+        cout << model->get_num_train_data() * num_repeats / sec << " sentences/sec, log_Pdataset " << setprecision(17) << log_Pdataset << setprecision(6) << endl;
+    }
+    delete model;
+}
+
+// bytes and tokens/sec of `compute_log_Pw` of the trained tree and of its frozen copy
+void benchmark_frozen_tree(string filename, int num_epochs, int num_repeats) {
+    PyVPYLM *model = train_model(filename, num_epochs);
+    long num_tokens = count_tokens(model->_dataset_train);
+    auto start = chrono::steady_clock::now();
+    FlatVPYLM frozen;
+    frozen.freeze(*model->_vpylm);
+    double freeze_sec = elapsed_seconds(start);
+    double log_Pdataset = 0;
+    start = chrono::steady_clock::now();
+    for (int repeat=0; repeat<num_repeats; ++repeat) {
+        log_Pdataset = 0;
+        for (auto &token_ids : model->_dataset_train) {
+            log_Pdataset += model->_vpylm->compute_log_Pw(token_ids);
+        }
+    }
+    double sec = elapsed_seconds(start);
+    double frozen_log_Pdataset = 0;
+    start = chrono::steady_clock::now();
+    for (int repeat=0; repeat<num_repeats; ++repeat) {
+        frozen_log_Pdataset = 0;
+        for (auto &token_ids : model->_dataset_train) {
+            frozen_log_Pdataset += frozen.compute_log_Pw(token_ids);
+        }
+    }
+    double frozen_sec = elapsed_seconds(start);
+    cout << "[frozen tree] " << model->get_num_nodes() << " nodes, freeze " << freeze_sec << " sec, ";
+    cout << model->_vpylm->get_num_bytes_reserved() << " vs " << frozen.get_num_bytes() << " bytes, ";
+    cout << (double)num_tokens * num_repeats / sec << " vs " << (double)num_tokens * num_repeats / frozen_sec << " tokens/sec, ";
+    cout << "log_Pdataset " << setprecision(17) << log_Pdataset << " vs " << frozen_log_Pdataset << setprecision(6) << endl;
+    delete model;
+}
+// tokens/sec of scoring the training data by whole sentences with `compute_log_Pw` and token by token with states
+void benchmark_scoring_state(string filename, int num_epochs, int num_repeats) {
+    PyVPYLM *model = train_model(filename, num_epochs);
+    long num_tokens = count_tokens(model->_dataset_train);
+    double log_Pdataset = 0;
+    auto start = chrono::steady_clock::now();
+    for (int repeat=0; repeat<num_repeats; ++repeat) {
+        log_Pdataset = 0;
+        for (auto &token_ids : model->_dataset_train) {
+            log_Pdataset += model->_vpylm->compute_log_Pw(token_ids);
+        }
+    }
+    double sec = elapsed_seconds(start);
+    double state_log_Pdataset = 0;
+    start = chrono::steady_clock::now();
+    for (int repeat=0; repeat<num_repeats; ++repeat) {
+        state_log_Pdataset = 0;
+        for (auto &token_ids : model->_dataset_train) {
+            ScoringState state = model->begin_state();
+            for (int token_t_index=1; token_t_index<token_ids.size(); ++token_t_index) {
+                state_log_Pdataset += model->_vpylm->score(state, token_ids[token_t_index], state);
+            }
+        }
+    }
+    double state_sec = elapsed_seconds(start);
+    cout << "[scoring state] " << (double)num_tokens * num_repeats / sec << " vs " << (double)num_tokens * num_repeats / state_sec << " tokens/sec, ";
+    cout << "log_Pdataset " << setprecision(17) << log_Pdataset << " vs " << state_log_Pdataset << setprecision(6) << endl;
+    delete model;
+}
+// sequences/sec of scoring n-best lists one hypothesis at a time and with the batch scorer; hypotheses of a test
+// sentence replace one or two of its tokens after a shared prefix of random length
+void benchmark_batch_scoring(string filename, int num_epochs, int num_hypotheses) {
+    PyVPYLM *model = train_model(filename, num_epochs);
+    mt19937 mt(0);
+    vector<vector<vector<id>>> nbest_lists;
+    int num_tokens = 0;
+    for (auto &token_ids : model->_dataset_test) {
+        if (token_ids.size() < 4) {
+            continue;
+        }
+        vector<vector<id>> hypotheses;
+        for (int n=0; n<num_hypotheses; ++n) {
+            vector<id> hypothesis = token_ids;
+            int num_edits = 1 + mt() % 2;
+            for (int edit=0; edit<num_edits; ++edit) {
+                int t = 1 + mt() % (hypothesis.size() - 2);
+                hypothesis[t] = model->_dataset_train[mt() % model->_dataset_train.size()][1];
+            }
+            num_tokens += hypothesis.size() - 1;
+            hypotheses.push_back(hypothesis);
+        }
+        nbest_lists.push_back(hypotheses);
+    }
+    int num_sequences = nbest_lists.size() * num_hypotheses;
+    double log_Pdataset = 0;
+    auto start = chrono::steady_clock::now();
+    for (auto &hypotheses : nbest_lists) {
+        for (auto &token_ids : hypotheses) {
+            log_Pdataset += model->_vpylm->compute_log_Pw(token_ids);
+        }
+    }
+    double sec = elapsed_seconds(start);
+    BatchScorer scorer;
+    vector<double> log_Pw;
+    double batch_log_Pdataset = 0;
+    start = chrono::steady_clock::now();
+    for (auto &hypotheses : nbest_lists) {
+        scorer.score(hypotheses, [&](const ScoringState &state, id token_id, ScoringState &next_state) {
+            return model->_vpylm->score(state, token_id, next_state);
+        }, log_Pw);
+        for (double value : log_Pw) {
+            batch_log_Pdataset += value;
+        }
+    }
+    double batch_sec = elapsed_seconds(start);
+    cout << "[batch scoring] " << nbest_lists.size() << " lists of " << num_hypotheses << ": ";
+    cout << num_sequences / sec << " vs " << num_sequences / batch_sec << " sequences/sec, ";
+    cout << scorer.get_num_evaluations() << " of " << num_tokens << " tokens scored, ";
+    cout << "log_Pdataset " << setprecision(17) << log_Pdataset << " vs " << batch_log_Pdataset << setprecision(6) << endl;
+    delete model;
+}
+// tokens/sec of scoring the test data and of scoring the whole vocabulary after test contexts, as top-k search and
+// generation do, without and with the context cache; the scores must be equal, also after a sweep changed the tree
+void benchmark_context_cache(string filename, int num_epochs, int num_contexts) {
+    PyVPYLM *model = train_model(filename, num_epochs);
+    int num_token_ids = model->_vocab->num_tokens();
+    auto evaluate = [&](double &sec) {
+        double log_Pdataset = 0;
+        auto start = chrono::steady_clock::now();
+        for (auto &token_ids : model->_dataset_test) {
+            log_Pdataset += model->_vpylm->compute_log_Pw(token_ids);
+        }
+        sec = elapsed_seconds(start);
+        return log_Pdataset;
+    };
+    auto score_vocabulary = [&](double &sec) {
+        double sum = 0;
+        auto start = chrono::steady_clock::now();
+        for (int n=0; n<num_contexts; ++n) {
+            vector<id> &token_ids = model->_dataset_test[n % model->_dataset_test.size()];
+            vector<id> context_token_ids(token_ids.begin(), token_ids.begin() + std::min<int>(1 + n % 4, token_ids.size()));
+            for (id token_id=1; token_id<num_token_ids; ++token_id) {
+                sum += model->_vpylm->compute_Pw_given_h(token_id, context_token_ids);
+            }
+        }
+        sec = elapsed_seconds(start);
+        return sum;
+    };
+    long num_tokens = count_tokens(model->_dataset_test);
+    double num_vocabulary_tokens = (double)num_contexts * (num_token_ids - 1);
+    double sec, cached_sec, vocabulary_sec, cached_vocabulary_sec;
+    double log_Pdataset = evaluate(sec);
+    double sum = score_vocabulary(vocabulary_sec);
+    model->set_context_cache(1 << 16);
+    double cached_log_Pdataset = evaluate(cached_sec);
+    ContextCacheStats evaluation_stats = model->_vpylm->get_context_cache_stats();
+    model->_vpylm->clear_context_cache_stats();
+    double cached_sum = score_vocabulary(cached_vocabulary_sec);
+    ContextCacheStats vocabulary_stats = model->_vpylm->get_context_cache_stats();
+    model->perform_gibbs_sampling();
+    double swept_sec;
+    double swept_cached_log_Pdataset = evaluate(swept_sec);
+    model->set_context_cache(0);
+    double swept_log_Pdataset = evaluate(swept_sec);
+    auto hit_rate = [](const ContextCacheStats &stats) {
+        return (double)stats.num_hits / std::max<long>(1, stats.num_hits + stats.num_misses);
+    };
+    cout << "[context cache] evaluation " << num_tokens / sec << " vs " << num_tokens / cached_sec << " tokens/sec, hit rate " << hit_rate(evaluation_stats) << ", ";
+    cout << "vocabulary " << num_vocabulary_tokens / vocabulary_sec << " vs " << num_vocabulary_tokens / cached_vocabulary_sec << " tokens/sec, hit rate " << hit_rate(vocabulary_stats) << ", ";
+    cout << "equal " << (log_Pdataset == cached_log_Pdataset && sum == cached_sum) << ", equal after sweep " << (swept_log_Pdataset == swept_cached_log_Pdataset) << endl;
+    delete model;
+}
+// sec to load the trained tree from the Boost archive and from the flat format, and sentences/sec of scoring with each
+void benchmark_flat_model(string filename, int num_epochs) {
+    PyVPYLM *model = train_model(filename, num_epochs);
+    model->_vpylm->save("benchmark.model");
+    FlatVPYLM::save(*model->_vpylm, "benchmark.flat");
+    auto start = chrono::steady_clock::now();
+    VPYLM *vpylm = new VPYLM();
+    vpylm->load("benchmark.model");
+    double load_sec = elapsed_seconds(start);
+    start = chrono::steady_clock::now();
+    FlatVPYLM *flat = new FlatVPYLM();
+    flat->load("benchmark.flat");
+    double load_flat_sec = elapsed_seconds(start);
+    double log_Pdataset = 0;
+    start = chrono::steady_clock::now();
+    for (auto &token_ids : model->_dataset_test) {
+        log_Pdataset += vpylm->compute_log_Pw(token_ids);
+    }
+    double sec = elapsed_seconds(start);
+    double flat_log_Pdataset = 0;
+    start = chrono::steady_clock::now();
+    for (auto &token_ids : model->_dataset_test) {
+        flat_log_Pdataset += flat->compute_log_Pw(token_ids);
+    }
+    double flat_sec = elapsed_seconds(start);
+    cout << "[flat model] " << model->get_num_nodes() << " nodes, load " << load_sec << " sec, load_flat " << load_flat_sec << " sec, ";
+    cout << model->get_num_test_data() / sec << " vs " << model->get_num_test_data() / flat_sec << " sentences/sec, ";
+    cout << "log_Pdataset " << setprecision(17) << log_Pdataset << " vs " << flat_log_Pdataset << setprecision(6) << endl;
+    delete flat;
+    delete vpylm;
+    std::remove("benchmark.model");
+    std::remove("benchmark.flat");
+    delete model;
+}
+// bytes and test perplexity of the trained tree frozen exactly and quantized to 16 and 8-bit codes
+void benchmark_quantization(string filename, int num_epochs) {
+    PyVPYLM *model = train_model(filename, num_epochs);
+    model->freeze();
+    size_t num_bytes = model->_flat->get_num_bytes();
+    double ppl = model->compute_perplexity_test();
+    cout << "[quantization] " << filename << ": flat " << num_bytes << " bytes, ppl " << setprecision(8) << ppl << endl;
+    for (int num_bits : {16, 8}) {
+        auto start = chrono::steady_clock::now();
+        model->quantize(num_bits);
+        double sec = elapsed_seconds(start);
+        double quantized_ppl = model->compute_perplexity_test();
+        cout << "[quantization] " << num_bits << " bits: " << model->_quantized->get_num_bytes() << " bytes (";
+        cout << (double)model->_quantized->get_num_bytes() / num_bytes << "), quantize " << sec << " sec, ";
+        cout << "ppl " << quantized_ppl << " (" << showpos << quantized_ppl - ppl << noshowpos << ")" << setprecision(6) << endl;
+    }
+    delete model;
+}
+// nodes, bytes of the flat format and test perplexity of the trained tree pruned to shrinking fractions of its size
+void benchmark_pruning(string filename, int num_epochs) {
+    PyVPYLM *model = train_model(filename, num_epochs);
+    size_t num_bytes = FlatVPYLM::get_num_bytes_of(*model->_vpylm);
+    double ppl = model->compute_perplexity_test();
+    cout << "[pruning] " << filename << ": " << model->get_num_nodes() << " nodes, " << num_bytes << " bytes, ppl " << ppl << endl;
+    for (int divisor : {2, 4, 8}) {
+        auto start = chrono::steady_clock::now();
+        int num_removed = FlatVPYLM::prune(*model->_vpylm, num_bytes / divisor);
+        double sec = elapsed_seconds(start);
+        double pruned_ppl = model->compute_perplexity_test();
+        cout << "[pruning] 1/" << divisor << ": removed " << num_removed << " in " << sec << " sec, ";
+        cout << model->get_num_nodes() << " nodes, " << FlatVPYLM::get_num_bytes_of(*model->_vpylm) << " bytes, ";
+        cout << "ppl " << pruned_ppl << " (" << showpos << pruned_ppl - ppl << noshowpos << ")" << endl;
+    }
+    delete model;
+}
+
+// seat and unseat every training token at the root restaurant, then resample hyperparameters
+void benchmark_root_restaurant(string filename, int num_epochs, int num_repeats) {
+    PyVPYLM *model = train_model(filename, num_epochs);
+    VPYLM *vpylm = model->_vpylm;
+    int max_tables = 0;
+    for (auto &elem : vpylm->_root->_arrangement) {
+        max_tables = std::max(max_tables, elem.second.num_tables());
+    }
+    int num_operations = 0;
+    auto start = chrono::steady_clock::now();
+    for (int repeat=0; repeat<num_repeats; ++repeat) {
+        for (auto &token_ids : model->_dataset_train) {
+            for (int token_t_index=1; token_t_index<token_ids.size(); ++token_t_index) {
+                vpylm->add_customer_at_timestep(token_ids, token_t_index, 0);
+                vpylm->remove_customer_at_timestep(token_ids, token_t_index, 0);
+                num_operations++;
+            }
+        }
+    }
+    double sec = elapsed_seconds(start);
+    start = chrono::steady_clock::now();
+    for (int repeat=0; repeat<num_repeats; ++repeat) {
+        vpylm->sample_hyperparams();
+    }
+    double hyperparams_sec = elapsed_seconds(start) / num_repeats;
+    cout << "[root] " << filename << ": " << vpylm->_root->_num_tables << " tables, max " << max_tables << " per word, ";
+    cout << num_operations / sec << " seat+unseat/sec, sample_hyperparams " << hyperparams_sec << " sec" << endl;
+    delete model;
+}
+
+// a single word eaten by `num_customers` customers at the root, as in corpora far larger than the bundled ones
+void benchmark_frequent_word(int num_customers, int num_repeats) {
+    VPYLM *vpylm = new VPYLM();
+    vpylm->_g0 = 1.0;
+    vector<id> token_ids = {ID_BOS, 2};
+    for (int n=0; n<num_customers; ++n) {
+        vpylm->add_customer_at_timestep(token_ids, 1, 0);
+    }
+    auto start = chrono::steady_clock::now();
+    for (int repeat=0; repeat<num_repeats; ++repeat) {
+        vpylm->add_customer_at_timestep(token_ids, 1, 0);
+        vpylm->remove_customer_at_timestep(token_ids, 1, 0);
+    }
+    double sec = elapsed_seconds(start);
+    cout << "[frequent word] " << num_customers << " customers, " << vpylm->_root->_num_tables << " tables: ";
+    cout << num_repeats / sec << " seat+unseat/sec" << endl;
+    delete vpylm;
+}
+
+// next-token samples/sec of `sample_next_token` against scoring every word with `compute_Pw_given_h`
+void benchmark_generation(string filename, int num_epochs, int num_samples) {
+    PyVPYLM *model = train_model(filename, num_epochs, false);
+    int num_token_ids = model->_vocab->num_tokens();
+    auto start = chrono::steady_clock::now();
+    for (int n=0; n<num_samples; ++n) {
+        vector<id> &token_ids = model->_dataset_test[n % model->_dataset_test.size()];
+        vector<id> context_token_ids(token_ids.begin(), token_ids.begin() + std::min<int>(3, token_ids.size()));
+        double sum = 0;
+        for (id token_id=1; token_id<num_token_ids; ++token_id) {
+            sum += model->_vpylm->compute_Pw_given_h(token_id, context_token_ids);
+        }
+    }
+    double naive_sec = elapsed_seconds(start);
+    start = chrono::steady_clock::now();
+    for (int n=0; n<num_samples; ++n) {
+        vector<id> &token_ids = model->_dataset_test[n % model->_dataset_test.size()];
+        vector<id> context_token_ids(token_ids.begin(), token_ids.begin() + std::min<int>(3, token_ids.size()));
+        model->_vpylm->sample_next_token(context_token_ids, num_token_ids);
+    }
+    double sec = elapsed_seconds(start);
+    cout << "[generation] " << filename << ": vocabulary " << num_token_ids << ", ";
+    cout << num_samples / naive_sec << " samples/sec per-word scoring, " << num_samples / sec << " samples/sec sample_next_token" << endl;
+    delete model;
+}
+
+// sweep time and RSS growth while training; nodes are created and deleted throughout the sweeps
+void benchmark_memory(string filename, int num_epochs) {
+    long rss_before = rss_kilobytes();
+    PyVPYLM *model = load_model(filename);
+    long rss_data = rss_kilobytes();
+    auto start = chrono::steady_clock::now();
+    for (int epoch=1; epoch<=num_epochs; ++epoch) {
+        model->perform_gibbs_sampling();
+        model->sample_hyperparams();
+    }
+    double sec = elapsed_seconds(start);
+    cout << "[memory] " << filename << ": " << sec / num_epochs << " sec/sweep, ";
+    cout << model->get_num_nodes() << " nodes, model RSS " << rss_kilobytes() - rss_data << " KB ";
+    cout << "(data " << rss_data - rss_before << " KB, slabs " << model->_vpylm->get_num_bytes_reserved() / 1024 << " KB, ";
+    cout << (double)model->_vpylm->get_num_bytes_reserved() / model->get_num_nodes() << " bytes/node)" << endl;
+    delete model;
+}
+
+// memory of a VPYLM with `IdT` token ids and `CountT` table counts trained on the data of `model`
+template<typename IdT, typename CountT>
+void benchmark_layout(PyVPYLM *model, string name, int num_epochs) {
+    if (model->_vocab->num_tokens() - 1 > std::numeric_limits<IdT>::max()) {
+        cout << "[layout " << name << "] vocabulary does not fit" << endl;
+        return;
+    }
+    vector<vector<IdT>> dataset_train;
+    vector<vector<IdT>> dataset_test;
+    for (auto &token_ids : model->_dataset_train) {
+        dataset_train.push_back(vector<IdT>(token_ids.begin(), token_ids.end()));
+    }
+    for (auto &token_ids : model->_dataset_test) {
+        dataset_test.push_back(vector<IdT>(token_ids.begin(), token_ids.end()));
+    }
+    vector<vector<int>> prev_depths(dataset_train.size());
+    sampler::set_seed(0);
+    BasicVPYLM<IdT, CountT> *vpylm = new BasicVPYLM<IdT, CountT>();
+    vpylm->_g0 = model->_vpylm->_g0;
+    auto start = chrono::steady_clock::now();
+    for (int epoch=1; epoch<=num_epochs; ++epoch) {
+        for (int data_index=0; data_index<dataset_train.size(); ++data_index) {
+            vector<IdT> &token_ids = dataset_train[data_index];
+            prev_depths[data_index].resize(token_ids.size(), -1);
+            for (int token_t_index=1; token_t_index<token_ids.size(); ++token_t_index) {
+                if (epoch > 1) {
+                    vpylm->remove_customer_at_timestep(token_ids, token_t_index, prev_depths[data_index][token_t_index]);
+                }
+                int depth = vpylm->sample_depth_at_timestep(token_ids, token_t_index);
+                vpylm->add_customer_at_timestep(token_ids, token_t_index, depth);
+                prev_depths[data_index][token_t_index] = depth;
+            }
+        }
+        vpylm->sample_hyperparams();
+    }
+    double sec = elapsed_seconds(start);
+    double log2_Pdataset = 0;
+    for (auto &token_ids : dataset_test) {
+        log2_Pdataset += vpylm->compute_log2_Pw(token_ids) / token_ids.size();
+    }
+    int num_nodes = vpylm->get_num_nodes();
+    cout << "[layout " << name << "] " << sizeof(IdT) << "-byte ids, " << sizeof(CountT) << "-byte counts: ";
+    cout << sec / num_epochs << " sec/sweep, " << num_nodes << " nodes, slabs " << vpylm->get_num_bytes_reserved() / 1024 << " KB, ";
+    cout << (double)vpylm->get_num_bytes_reserved() / num_nodes << " bytes/node, ";
+    cout << "ppl " << pow(2.0, -log2_Pdataset / dataset_test.size()) << endl;
+    delete vpylm;
+}
+
+void benchmark_layouts(string filename, int num_epochs) {
+    PyVPYLM *model = load_model(filename);
+    benchmark_layout<uint32_t, int>(model, "uint32/int", num_epochs);
+    benchmark_layout<uint32_t, uint16_t>(model, "uint32/uint16", num_epochs);
+    benchmark_layout<uint16_t, uint16_t>(model, "uint16/uint16", num_epochs);
+    benchmark_layout<uint16_t, uint8_t>(model, "uint16/uint8", num_epochs);
+    delete model;
+}
+
+// draws/sec of an engine: raw words, uniforms from a new distribution per call as sampler did before, buffered uniforms
+template<typename EngineT>
+void benchmark_engine(string name, int num_draws) {
+    EngineT e(0);
+    uint64_t sum_words = 0;
+    auto start = chrono::steady_clock::now();
+    for (int i=0; i<num_draws; ++i) {
+        sum_words += e();
+    }
+    double raw_sec = elapsed_seconds(start);
+    double sum = 0;
+    start = chrono::steady_clock::now();
+    for (int i=0; i<num_draws; ++i) {
+        uniform_real_distribution<double> rand(0, 1);
+        sum += rand(e);
+    }
+    double distribution_sec = elapsed_seconds(start);
+    sampler::UniformBuffer<EngineT> buffer;
+    start = chrono::steady_clock::now();
+    for (int i=0; i<num_draws; ++i) {
+        sum += buffer.next(&e);
+    }
+    double buffered_sec = elapsed_seconds(start);
+    cout << "[rng] " << name << ": " << num_draws / raw_sec << " words/sec, ";
+    cout << num_draws / distribution_sec << " uniforms/sec with a distribution per call, ";
+    cout << num_draws / buffered_sec << " buffered uniforms/sec (" << (sum_words & 1) + (sum > 0) << ")" << endl;
+}
+void benchmark_rng(int num_draws) {
+    benchmark_engine<mt19937>("mt19937", num_draws);
+    benchmark_engine<sampler::Xoshiro256pp>("xoshiro256++", num_draws);
+    benchmark_engine<sampler::Philox4x32>("philox4x32-10", num_draws);
+    // gamma_distribution per call as sampler did before, against sampler::gamma on the buffered uniforms
+    mt19937 mt(0);
+    double sum = 0;
+    auto start = chrono::steady_clock::now();
+    for (int i=0; i<num_draws / 10; ++i) {
+        gamma_distribution<double> distribution(2.0, 1.0);
+        sum += distribution(mt);
+    }
+    double distribution_sec = elapsed_seconds(start);
+    start = chrono::steady_clock::now();
+    for (int i=0; i<num_draws / 10; ++i) {
+        sum += sampler::gamma(2.0, 1.0);
+    }
+    double sampler_sec = elapsed_seconds(start);
+    cout << "[rng] gamma: " << num_draws / 10 / distribution_sec << " draws/sec with gamma_distribution and mt19937, ";
+    cout << num_draws / 10 / sampler_sec << " draws/sec with sampler::gamma (" << (sum > 0) << ")" << endl;
+}
+int main(int argc, char *argv[]) {
+    string filename = "data/processed/wiki.txt";
+    if (argc > 1) {
+        filename = argv[1];
+    }
+    benchmark_memory(filename, 20);
+    benchmark_layouts(filename, 20);
+    benchmark_gibbs_sampling(filename, 20);
+    benchmark_parallel_gibbs_sampling(filename, 20, false);
+    benchmark_parallel_gibbs_sampling(filename, 20, true);
+    benchmark_chains(filename, 20);
+    benchmark_sample_depth(filename, 20, 5);
+    benchmark_find_node(filename, 20, 20);
+    benchmark_sample_hyperparams(filename, 20, 5);
+    benchmark_evaluation(filename, 20, 5);
+    benchmark_frozen_tree(filename, 20, 5);
+    benchmark_scoring_state(filename, 20, 5);
+    benchmark_batch_scoring(filename, 20, 100);
+    benchmark_context_cache(filename, 20, 200);
+    benchmark_flat_model(filename, 20);
+    benchmark_quantization(filename, 20);
+    benchmark_pruning(filename, 20);
+    benchmark_root_restaurant(filename, 20, 5);
+    benchmark_frequent_word(1000000, 100000);
+    benchmark_rng(100000000);
+    benchmark_generation(filename, 20, 200);
+}
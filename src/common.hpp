@@ -1,8 +1,20 @@
+#pragma once
 #include <unordered_map>
+#include <cstdint>
 #include "hashmap.hpp"
+#include "allocator.hpp"
 template<class T, class U>
 // using hashmap = std::unordered_map<T, U>;
-using hashmap = emilib::HashMap<T, U>;
+using hashmap = emilib::HashMap<T, U, std::hash<T>, emilib::HashMapEqualTo<T>, SlabAllocation>;
+// nodes are aligned, so their addresses are mixed before the buckets are masked
+struct PointerHash {
+    template<class T>
+    size_t operator()(T *pointer) const {
+        return ((uintptr_t)pointer >> 4) * 0x9E3779B97F4A7C15ULL >> 16;
+    }
+};
+template<class T, class U>
+using pointer_hashmap = emilib::HashMap<T*, U, PointerHash, emilib::HashMapEqualTo<T*>, SlabAllocation>;
 
 #define HPYLM_INITIAL_D 0.5
 #define HPYLM_INITIAL_THETA 2.0
@@ -14,6 +26,35 @@ using hashmap = emilib::HashMap<T, U>;
 #define VPYLM_BETA_STOP 4
 #define VPYLM_BETA_PASS 1
 
-using id = size_t;
+// entries kept inline in each node before falling back to a hash map
+#define VPYLM_INLINE_CHILDREN 2
+#define VPYLM_INLINE_WORDS 2
+
+// sentences resampled in parallel between two synchronizations of a parallel sweep
+#define VPYLM_SYNC_INTERVAL 256
+
+// threads seating into a shared tree keep back pass counts of nodes shallower than this, which all of them pass,
+// and apply them every VPYLM_HOGWILD_FLUSH_INTERVAL tokens
+#define VPYLM_HOGWILD_BUFFERED_DEPTH 2
+#define VPYLM_HOGWILD_FLUSH_INTERVAL 64
+
+// subtrees of the root sharing one random stream when resampling hyperparameters
+#define VPYLM_HYPERPARAMS_CHUNK_SIZE 64
+
+// tokens of the sentences a thread takes at once in parallel sweeps and when scoring a dataset
+#define VPYLM_BATCH_NUM_TOKENS 256
+
+// tokens of context a scoring state keeps; scores with it equal those given whole histories while the tree is no deeper
+#define VPYLM_SCORING_STATE_ORDER 32
+
+using id = uint32_t;
 #define ID_BOS 0
-#define ID_EOS 1
\ No newline at end of file
+#define ID_EOS 1
+#define ID_UNKNOWN ((id)-1)     // words outside the vocabulary
+
+// customers at one table; narrow counts save memory and are promoted to int by the tables that outgrow them
+#ifdef VPYLM_NARROW_TABLE_COUNTS
+using table_count = uint16_t;
+#else
+using table_count = int;
+#endif
\ No newline at end of file
@@ -0,0 +1,156 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include "common.hpp"
+using namespace std;
+
+// context tokens a cached path may depend on; contexts whose path depends on older tokens are not cached
+#define VPYLM_CONTEXT_CACHE_ORDER 8
+
+// nodes a context reaches from the root, with the stop probability of each and the pass probability left beyond
+// the deepest one, 0 if the walk was censored; Pw of any token follows by one pass over the nodes
+template<typename NodeT>
+struct BasicContextPath {
+    NodeT *nodes[VPYLM_CONTEXT_CACHE_ORDER + 1];
+    double p_stops[VPYLM_CONTEXT_CACHE_ORDER + 1];
+    int num_nodes;
+    double p_pass;
+};
+
+struct ContextCacheStats {
+    long num_hits;
+    long num_misses;
+    long num_invalidations;
+
+    ContextCacheStats() {
+        clear();
+    }
+    void clear() {
+        num_hits = 0;
+        num_misses = 0;
+        num_invalidations = 0;
+    }
+};
+
+// direct-mapped cache of context paths keyed by a hash of the last VPYLM_CONTEXT_CACHE_ORDER context tokens
+// entries are stamped with the epoch in which they were traced, and `invalidate` starts a new epoch, so that paths
+// to nodes that may have changed or been deleted are never read again
+// threads share the cache; an entry busy in another thread counts as a miss
+template<typename IdT, typename NodeT>
+class BasicContextCache {
+public:
+    using ContextPath = BasicContextPath<NodeT>;
+private:
+    struct Entry {
+        std::atomic_flag lock;
+        uint64_t epoch;             // 0 while empty
+        int key_size;               // context tokens, or VPYLM_CONTEXT_CACHE_ORDER + 1 for longer contexts
+        IdT key[VPYLM_CONTEXT_CACHE_ORDER];
+        ContextPath path;
+    };
+    vector<Entry> _entries;
+    std::atomic<uint64_t> _epoch;
+    std::atomic<long> _num_hits;
+    std::atomic<long> _num_misses;
+    std::atomic<long> _num_invalidations;
+
+    template<typename ContextT>
+    static int key_size_of(const ContextT &context) {
+        return std::min(context.size(), VPYLM_CONTEXT_CACHE_ORDER + 1);
+    }
+    template<typename ContextT>
+    Entry &entry_of(const ContextT &context, int key_size) {
+        uint64_t hash = key_size;
+        for (int n=0; n<std::min(key_size, VPYLM_CONTEXT_CACHE_ORDER); ++n) {
+            hash = (hash ^ context.recent(n)) * 0x9E3779B97F4A7C15ULL;
+        }
+        return _entries[(hash >> 32) & (_entries.size() - 1)];
+    }
+    static int round_up_to_power_of_2(int num) {
+        int size = 1;
+        while (size < num) {
+            size *= 2;
+        }
+        return size;
+    }
+public:
+    // `num_entries` is rounded up to a power of 2
+    BasicContextCache(int num_entries) : _entries(round_up_to_power_of_2(num_entries)), _epoch(1), _num_hits(0), _num_misses(0), _num_invalidations(0) {
+        for (Entry &entry : _entries) {
+            entry.lock.clear();
+            entry.epoch = 0;
+        }
+    }
+    BasicContextCache(const BasicContextCache &) = delete;
+    BasicContextCache &operator=(const BasicContextCache &) = delete;
+    // copies the path of `context` traced in this epoch into `path`; false if there is none
+    template<typename ContextT>
+    bool find(const ContextT &context, ContextPath &path) {
+        int key_size = key_size_of(context);
+        Entry &entry = entry_of(context, key_size);
+        bool found = false;
+        if (entry.lock.test_and_set(std::memory_order_acquire) == false) {
+            found = entry.epoch == _epoch.load(std::memory_order_relaxed) && entry.key_size == key_size;
+            for (int n=0; found && n<std::min(key_size, VPYLM_CONTEXT_CACHE_ORDER); ++n) {
+                found = entry.key[n] == context.recent(n);
+            }
+            if (found) {
+                path.num_nodes = entry.path.num_nodes;
+                path.p_pass = entry.path.p_pass;
+                for (int n=0; n<path.num_nodes; ++n) {
+                    path.nodes[n] = entry.path.nodes[n];
+                    path.p_stops[n] = entry.path.p_stops[n];
+                }
+            }
+            entry.lock.clear(std::memory_order_release);
+        }
+        (found ? _num_hits : _num_misses).fetch_add(1, std::memory_order_relaxed);
+        return found;
+    }
+    // epoch to pass to `insert` for a path traced from now on
+    uint64_t get_epoch() const {
+        return _epoch.load(std::memory_order_relaxed);
+    }
+    // `path` must depend on the last VPYLM_CONTEXT_CACHE_ORDER tokens of `context` only, and have been traced in
+    // `epoch`; it is dropped if the tree changed since
+    template<typename ContextT>
+    void insert(const ContextT &context, const ContextPath &path, uint64_t epoch) {
+        if (epoch != get_epoch()) {
+            return;
+        }
+        int key_size = key_size_of(context);
+        Entry &entry = entry_of(context, key_size);
+        if (entry.lock.test_and_set(std::memory_order_acquire)) {
+            return;
+        }
+        entry.epoch = epoch;
+        entry.key_size = key_size;
+        for (int n=0; n<std::min(key_size, VPYLM_CONTEXT_CACHE_ORDER); ++n) {
+            entry.key[n] = context.recent(n);
+        }
+        entry.path = path;
+        entry.lock.clear(std::memory_order_release);
+    }
+    // drops every entry; call whenever the counts or the nodes of the tree change
+    void invalidate() {
+        _epoch.fetch_add(1, std::memory_order_relaxed);
+        _num_invalidations.fetch_add(1, std::memory_order_relaxed);
+    }
+    int get_num_entries() const {
+        return _entries.size();
+    }
+    ContextCacheStats get_stats() const {
+        ContextCacheStats stats;
+        stats.num_hits = _num_hits.load(std::memory_order_relaxed);
+        stats.num_misses = _num_misses.load(std::memory_order_relaxed);
+        stats.num_invalidations = _num_invalidations.load(std::memory_order_relaxed);
+        return stats;
+    }
+    void clear_stats() {
+        _num_hits = 0;
+        _num_misses = 0;
+        _num_invalidations = 0;
+    }
+};
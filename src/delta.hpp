@@ -0,0 +1,143 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "common.hpp"
+#include "node.hpp"
+using namespace std;
+
+// counts a batch of sentences adds to and takes from the shared tree between two synchronizations of a parallel sweep
+// the shared tree stays read-only meanwhile; the batch sees its own moves only through these counts
+// seatings follow the minimal path assumption: a customer opens a table only for a word new to the restaurant
+template<typename IdT, typename CountT>
+class BasicTreeDelta {
+public:
+    using Node = BasicNode<IdT, CountT>;
+    struct NodeCounts {
+        int num_customers;
+        int num_tables;
+        int stop_count;
+        int pass_count;
+    };
+    struct WordCounts {
+        int num_customers;
+        int num_tables;
+    };
+    struct WordKey {
+        Node *node;
+        IdT token_id;
+        bool operator==(const WordKey &other) const {
+            return node == other.node && token_id == other.token_id;
+        }
+    };
+    // the node is mixed as by `PointerHash`
+    struct WordKeyHash {
+        size_t operator()(const WordKey &key) const {
+            return (((uintptr_t)key.node >> 4) ^ ((uint64_t)key.token_id << 32)) * 0x9E3779B97F4A7C15ULL >> 16;
+        }
+    };
+    // owns the memory of the counts below; declared first so that it outlives them
+    SlabAllocator _allocator;
+    pointer_hashmap<Node, NodeCounts> _nodes;
+    emilib::HashMap<WordKey, WordCounts, WordKeyHash, emilib::HashMapEqualTo<WordKey>, SlabAllocation> _words;
+
+    bool empty() const {
+        return _nodes.empty();
+    }
+    void clear() {
+        _nodes.clear();
+        _words.clear();
+    }
+    const NodeCounts *find_node_counts(Node *node) const {
+        return _nodes.try_get(node);
+    }
+    const WordCounts *find_word_counts(Node *node, IdT token_id) const {
+        return _words.try_get(WordKey{node, token_id});
+    }
+    // zero-initialized on first use
+    NodeCounts &node_counts(Node *node) {
+        return _nodes[node];
+    }
+    WordCounts &word_counts(Node *node, IdT token_id) {
+        return _words[WordKey{node, token_id}];
+    }
+    // a customer of `token_id` stopping at `depth` of `path`, the nodes from the root that exist on its context
+    // nodes beyond the path do not exist yet; the customer passes the deepest one and reaches it through proxies
+    void add_customer(vector<Node*> &path, int depth, IdT token_id) {
+        int n = std::min<int>(depth, path.size() - 1);
+        for (int m=0; m<n; ++m) {
+            node_counts(path[m]).pass_count++;
+        }
+        if (depth == n) {
+            node_counts(path[n]).stop_count++;
+        } else {
+            node_counts(path[n]).pass_count++;
+        }
+        for (int m=n; m>=0; --m) {
+            Node *node = path[m];
+            WordCounts &word = word_counts(node, token_id);
+            NodeCounts &counts = node_counts(node);
+            bool word_is_new = node->get_num_customers_eating_word(token_id) + word.num_customers == 0;
+            word.num_customers++;
+            counts.num_customers++;
+            if (word_is_new == false) {
+                break;
+            }
+            word.num_tables++;
+            counts.num_tables++;
+        }
+    }
+    // the customer of `token_id` seated at `depth` of `path` taken away; as the counterpart of `add_customer`, a table
+    // closes only where the customers left could no longer fill the tables
+    void remove_customer(vector<Node*> &path, int depth, IdT token_id) {
+        for (int m=0; m<depth; ++m) {
+            node_counts(path[m]).pass_count--;
+        }
+        node_counts(path[depth]).stop_count--;
+        for (int m=depth; m>=0; --m) {
+            Node *node = path[m];
+            WordCounts &word = word_counts(node, token_id);
+            NodeCounts &counts = node_counts(node);
+            word.num_customers--;
+            counts.num_customers--;
+            int c_uw = node->get_num_customers_eating_word(token_id) + word.num_customers;
+            int t_uw = node->get_num_tables_serving_word(token_id) + word.num_tables;
+            if (c_uw >= t_uw) {
+                break;
+            }
+            word.num_tables--;
+            counts.num_tables--;
+        }
+    }
+    // Pw of `node` and its own stop and pass probabilities with the counts of this delta
+    void compute_probabilities(Node *node, IdT token_id, double parent_pw, vector<double> &d_m, vector<double> &theta_m,
+                               double beta_stop, double beta_pass, double &pw, double &p_stop, double &p_pass) const {
+        double d_u = d_m[node->_depth];
+        double theta_u = theta_m[node->_depth];
+        double c_u = node->_num_customers;
+        double t_u = node->_num_tables;
+        double stop_count = node->_stop_count;
+        double pass_count = node->_pass_count;
+        const NodeCounts *counts = find_node_counts(node);
+        if (counts) {
+            c_u += counts->num_customers;
+            t_u += counts->num_tables;
+            stop_count += counts->stop_count;
+            pass_count += counts->pass_count;
+        }
+        double c_uw = 0;
+        double t_uw = 0;
+        auto itr = node->_arrangement.find(token_id);
+        if (itr != node->_arrangement.end()) {
+            c_uw = itr->second.num_customers();
+            t_uw = itr->second.num_tables();
+        }
+        const WordCounts *word = find_word_counts(node, token_id);
+        if (word) {
+            c_uw += word->num_customers;
+            t_uw += word->num_tables;
+        }
+        pw = (std::max(0.0, c_uw - d_u * t_uw) + (theta_u + d_u * t_u) * parent_pw) / (theta_u + c_u);
+        p_stop = (stop_count + beta_stop) / (stop_count + pass_count + beta_stop + beta_pass);
+        p_pass = (pass_count + beta_pass) / (stop_count + pass_count + beta_stop + beta_pass);
+    }
+};
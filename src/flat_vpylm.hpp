@@ -0,0 +1,477 @@
+#pragma once
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "common.hpp"
+#include "vpylm.hpp"
+#include "scoring_state.hpp"
+using namespace std;
+
+#define FLAT_VPYLM_MAGIC "VPYLMFLT"
+#define FLAT_VPYLM_VERSION 2
+
+// immutable VPYLM for scoring, either frozen from a trained tree or memory-mapped from a file with no deserialization
+// the tree is laid out as contiguous arrays: nodes in BFS order, so that the children of a node are consecutive, and
+// the words of every node, also consecutive; a node keeps counts only, and every word its c_uw and t_uw
+// each range is sorted by token id in Eytzinger order, i.e. as the BFS of a balanced search tree, so that lookups
+// descend with one comparison and no branch per level
+template<typename IdT>
+class BasicFlatVPYLM {
+public:
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t id_bytes;
+        uint64_t num_nodes;
+        uint64_t num_words;         // entries of all arrangements
+        uint64_t num_depths;        // of d_m and theta_m
+        uint64_t num_root_words;    // of the root indexed by token id, see `_root_words`
+        double g0;
+        double beta_stop;
+        double beta_pass;
+        // byte offsets of the arrays from the start of the file
+        uint64_t d_m_offset;
+        uint64_t theta_m_offset;
+        uint64_t node_token_ids_offset;
+        uint64_t nodes_offset;
+        uint64_t word_token_ids_offset;
+        uint64_t words_offset;
+        uint64_t root_words_offset;
+        uint64_t file_size;
+    };
+    struct Node {
+        int32_t num_customers;
+        int32_t num_tables;
+        int32_t stop_count;
+        int32_t pass_count;
+        uint32_t children_begin;    // index of the first child in the node arrays
+        uint32_t num_children;
+        uint32_t words_begin;       // index of the first word in the word arrays
+        uint32_t num_words;
+    };
+    struct Word {
+        int32_t num_customers;      // c_uw
+        int32_t num_tables;         // t_uw
+    };
+private:
+    void *_data;
+    size_t _size;
+    bool _mapped;                   // `_data` is a mapping of a file rather than `_buffer`
+    vector<uint64_t> _buffer;       // of a frozen tree
+    const Header *_header;
+    const double *_d_m;
+    const double *_theta_m;
+    const IdT *_node_token_ids;     // indexed like `_nodes`
+    const Node *_nodes;
+    const IdT *_word_token_ids;     // indexed like `_words`
+    const Word *_words;
+    const Word *_root_words;        // words of the root again, indexed by token id, as it serves most of the vocabulary
+    template<typename> friend class BasicQuantizedVPYLM;
+
+    template<typename T>
+    static void append_array(vector<char> &bytes, const vector<T> &values, uint64_t &offset) {
+        // every array starts on an 8-byte boundary
+        bytes.resize((bytes.size() + 7) / 8 * 8, 0);
+        offset = bytes.size();
+        bytes.insert(bytes.end(), (const char*)values.data(), (const char*)(values.data() + values.size()));
+    }
+    // eytzinger[k] = sorted[i] where k is the BFS index of i in a balanced search tree over `sorted`
+    template<typename T>
+    static void to_eytzinger(const vector<T> &sorted, vector<T> &eytzinger, int &i, int k) {
+        if (k > sorted.size()) {
+            return;
+        }
+        to_eytzinger(sorted, eytzinger, i, 2 * k);
+        eytzinger[k - 1] = sorted[i++];
+        to_eytzinger(sorted, eytzinger, i, 2 * k + 1);
+    }
+    template<typename T>
+    static void to_eytzinger(const vector<T> &sorted, vector<T> &eytzinger) {
+        eytzinger.resize(sorted.size());
+        int i = 0;
+        to_eytzinger(sorted, eytzinger, i, 1);
+    }
+    // position of `token_id` in `token_ids[0, n)` laid out in Eytzinger order, or -1
+    static long search(const IdT *token_ids, uint32_t n, IdT token_id) {
+        // descend to the leaf, going right past every key below `token_id`
+        uint64_t k = 1;
+        while (k <= n) {
+            // the 16 descendants 4 levels down share a cache line
+            __builtin_prefetch(token_ids + 16 * k - 1);
+            k = 2 * k + (token_ids[k - 1] < token_id);
+        }
+        // the last left turn is the first key not below `token_id`
+        k >>= __builtin_ffsll(~k);
+        if (k == 0 || token_ids[k - 1] != token_id) {
+            return -1;
+        }
+        return k - 1;
+    }
+    template<typename T>
+    const T *array_at(uint64_t offset, uint64_t count) {
+        if (offset % 8 != 0 || offset > _size || count > (_size - offset) / sizeof(T)) {
+            throw std::runtime_error("the flat model file is truncated or corrupt");
+        }
+        return (const T*)((const char*)_data + offset);
+    }
+    // index of the child of `node` for `token_id`, or -1
+    long find_child(const Node &node, IdT token_id) const {
+        long k = search(_node_token_ids + node.children_begin, node.num_children, token_id);
+        if (k < 0) {
+            return -1;
+        }
+        return node.children_begin + k;
+    }
+    const Word *find_word(const Node &node, IdT token_id) const {
+        if (&node == _nodes) {
+            if (token_id >= _header->num_root_words || _root_words[token_id].num_customers == 0) {
+                return NULL;
+            }
+            return _root_words + token_id;
+        }
+        long k = search(_word_token_ids + node.words_begin, node.num_words, token_id);
+        if (k < 0) {
+            return NULL;
+        }
+        return _words + node.words_begin + k;
+    }
+    // points the arrays into `_data`; throws unless it holds a flat model with ids of this width
+    void attach() {
+        _header = (const Header*)_data;
+        if (std::memcmp(_header->magic, FLAT_VPYLM_MAGIC, sizeof(_header->magic)) != 0 || _header->version != FLAT_VPYLM_VERSION) {
+            throw std::runtime_error("not a flat model of version " + std::to_string(FLAT_VPYLM_VERSION));
+        }
+        if (_header->id_bytes != sizeof(IdT)) {
+            throw std::runtime_error("the flat model was saved with " + std::to_string(_header->id_bytes) + "-byte token ids");
+        }
+        if (_header->file_size != _size || _header->num_nodes == 0 || _header->num_depths == 0) {
+            throw std::runtime_error("the flat model file is truncated or corrupt");
+        }
+        _d_m = array_at<double>(_header->d_m_offset, _header->num_depths);
+        _theta_m = array_at<double>(_header->theta_m_offset, _header->num_depths);
+        _node_token_ids = array_at<IdT>(_header->node_token_ids_offset, _header->num_nodes);
+        _nodes = array_at<Node>(_header->nodes_offset, _header->num_nodes);
+        _word_token_ids = array_at<IdT>(_header->word_token_ids_offset, _header->num_words);
+        _words = array_at<Word>(_header->words_offset, _header->num_words);
+        _root_words = array_at<Word>(_header->root_words_offset, _header->num_root_words);
+        // the ranges of the nodes must tile the arrays in the breadth-first order `freeze` writes, so that no lookup
+        // leaves them and no node is deeper than the hyperparameters
+        uint64_t num_nodes = 1;
+        uint64_t num_words = 0;
+        uint64_t depth = 0;
+        uint64_t depth_end = 1;     // end of the nodes at `depth`
+        for (uint64_t index=0; index<_header->num_nodes; ++index) {
+            if (index == depth_end) {
+                depth++;
+                depth_end = num_nodes;
+            }
+            const Node &node = _nodes[index];
+            if (node.children_begin != num_nodes || node.num_children > _header->num_nodes - num_nodes
+                || node.words_begin != num_words || node.num_words > _header->num_words - num_words
+                || depth >= _header->num_depths) {
+                throw std::runtime_error("the flat model file is truncated or corrupt");
+            }
+            num_nodes += node.num_children;
+            num_words += node.num_words;
+        }
+        if (num_nodes != _header->num_nodes || num_words != _header->num_words) {
+            throw std::runtime_error("the flat model file is truncated or corrupt");
+        }
+    }
+    // same arithmetic as `BasicNode::compute_Pw_with_parent_Pw`, so that both give the same bits
+    double compute_Pw_with_parent_Pw(const Node &node, int depth, IdT token_id, double parent_pw) const {
+        double d_u = _d_m[depth];
+        double theta_u = _theta_m[depth];
+        double t_u = node.num_tables;
+        double c_u = node.num_customers;
+        const Word *word = find_word(node, token_id);
+        if (word == NULL) {
+            double coeff = (theta_u + d_u * t_u) / (theta_u + c_u);
+            return parent_pw * coeff;
+        }
+        double c_uw = word->num_customers;
+        double t_uw = word->num_tables;
+        double first_term = std::max(0.0, c_uw - d_u * t_uw) / (theta_u + c_u);
+        double second_coeff = (theta_u + d_u * t_u) / (theta_u + c_u);
+        return first_term + second_coeff * parent_pw;
+    }
+public:
+    BasicFlatVPYLM() {
+        _data = NULL;
+        _size = 0;
+        _mapped = false;
+    }
+    BasicFlatVPYLM(const BasicFlatVPYLM &) = delete;
+    BasicFlatVPYLM &operator=(const BasicFlatVPYLM &) = delete;
+    ~BasicFlatVPYLM() {
+        unload();
+    }
+    // converts `model` into this structure; hyperparameters of every depth of the tree are initialized if needed
+    template<typename CountT>
+    void freeze(BasicVPYLM<IdT, CountT> &model) {
+        using TreeNode = BasicNode<IdT, CountT>;
+        unload();
+        model.init_hyperparams_at_depth_if_needed(model.get_depth());
+        vector<TreeNode*> order;
+        vector<IdT> node_token_ids;
+        vector<Node> nodes;
+        vector<IdT> word_token_ids;
+        vector<Word> words;
+        order.push_back(model._root);
+        node_token_ids.push_back(0);
+        vector<pair<IdT, TreeNode*>> children;
+        vector<pair<IdT, TreeNode*>> eytzinger_children;
+        vector<IdT> arrangement;
+        vector<IdT> eytzinger_arrangement;
+        for (size_t index=0; index<order.size(); ++index) {
+            TreeNode *tree_node = order[index];
+            Node node;
+            node.num_customers = tree_node->_num_customers;
+            node.num_tables = tree_node->_num_tables;
+            node.stop_count = tree_node->_stop_count;
+            node.pass_count = tree_node->_pass_count;
+            children.clear();
+            for (auto &elem : tree_node->_children) {
+                children.push_back(elem);
+            }
+            std::sort(children.begin(), children.end());
+            to_eytzinger(children, eytzinger_children);
+            node.children_begin = order.size();
+            node.num_children = children.size();
+            for (auto &elem : eytzinger_children) {
+                order.push_back(elem.second);
+                node_token_ids.push_back(elem.first);
+            }
+            arrangement.clear();
+            for (auto &elem : tree_node->_arrangement) {
+                arrangement.push_back(elem.first);
+            }
+            std::sort(arrangement.begin(), arrangement.end());
+            to_eytzinger(arrangement, eytzinger_arrangement);
+            node.words_begin = words.size();
+            node.num_words = arrangement.size();
+            for (IdT token_id : eytzinger_arrangement) {
+                auto &tables = tree_node->_arrangement.find(token_id)->second;
+                word_token_ids.push_back(token_id);
+                words.push_back(Word{(int32_t)tables.num_customers(), (int32_t)tables.num_tables()});
+            }
+            nodes.push_back(node);
+        }
+        vector<Word> root_words;
+        for (uint32_t i=0; i<nodes[0].num_words; ++i) {
+            IdT token_id = word_token_ids[i];
+            if (token_id >= root_words.size()) {
+                root_words.resize(token_id + 1, Word{0, 0});
+            }
+            root_words[token_id] = words[i];
+        }
+        if (order.size() > std::numeric_limits<uint32_t>::max() || words.size() > std::numeric_limits<uint32_t>::max()) {
+            throw std::runtime_error("the model is too large for the flat format");
+        }
+        Header header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, FLAT_VPYLM_MAGIC, sizeof(header.magic));
+        header.version = FLAT_VPYLM_VERSION;
+        header.id_bytes = sizeof(IdT);
+        header.num_nodes = nodes.size();
+        header.num_words = words.size();
+        header.num_depths = model._d_m.size();
+        header.num_root_words = root_words.size();
+        header.g0 = model._g0;
+        header.beta_stop = model._beta_stop;
+        header.beta_pass = model._beta_pass;
+        vector<char> bytes(sizeof(header));
+        append_array(bytes, model._d_m, header.d_m_offset);
+        append_array(bytes, model._theta_m, header.theta_m_offset);
+        append_array(bytes, node_token_ids, header.node_token_ids_offset);
+        append_array(bytes, nodes, header.nodes_offset);
+        append_array(bytes, word_token_ids, header.word_token_ids_offset);
+        append_array(bytes, words, header.words_offset);
+        append_array(bytes, root_words, header.root_words_offset);
+        bytes.resize((bytes.size() + 7) / 8 * 8, 0);
+        header.file_size = bytes.size();
+        std::memcpy(bytes.data(), &header, sizeof(header));
+        _buffer.resize(bytes.size() / 8);
+        std::memcpy(_buffer.data(), bytes.data(), bytes.size());
+        _data = _buffer.data();
+        _size = bytes.size();
+        attach();
+    }
+    // size `freeze` would give `model`, without building it
+    template<typename CountT>
+    static size_t get_num_bytes_of(BasicVPYLM<IdT, CountT> &model) {
+        size_t num_root_words = 0;
+        for (auto &elem : model._root->_arrangement) {
+            num_root_words = std::max<size_t>(num_root_words, elem.first + 1);
+        }
+        size_t num_depths = std::max<size_t>(model._d_m.size(), model.get_depth() + 1);
+        size_t num_nodes = model.get_num_nodes() + 1;
+        size_t num_words = model.get_num_words();
+        size_t sizes[] = {num_depths * sizeof(double), num_depths * sizeof(double), num_nodes * sizeof(IdT),
+                          num_nodes * sizeof(Node), num_words * sizeof(IdT), num_words * sizeof(Word),
+                          num_root_words * sizeof(Word)};
+        size_t num_bytes = sizeof(Header);
+        for (size_t size : sizes) {
+            num_bytes = (num_bytes + 7) / 8 * 8 + size;
+        }
+        return (num_bytes + 7) / 8 * 8;
+    }
+    // prunes `model` by `BasicVPYLM::prune` until `freeze` would take at most `max_num_bytes`, or only the root is
+    // left; returns the number of removed nodes
+    template<typename CountT>
+    static int prune(BasicVPYLM<IdT, CountT> &model, size_t max_num_bytes) {
+        double node_bytes = sizeof(IdT) + sizeof(Node);
+        double word_bytes = sizeof(IdT) + sizeof(Word);
+        // the rest does not change when leaves are folded, but for padding of at most 7 bytes after each of 8 parts
+        double fixed_bytes = get_num_bytes_of(model) - node_bytes * model.get_num_nodes() - word_bytes * model.get_num_words() + 8 * 7;
+        return model.prune(max_num_bytes - fixed_bytes, node_bytes, word_bytes);
+    }
+    // writes the structure to a file that `load` maps as is
+    bool save(string filename) const {
+        std::ofstream ofs(filename, std::ios::binary);
+        if (ofs.good() == false) {
+            return false;
+        }
+        ofs.write((const char*)_data, _size);
+        return ofs.good();
+    }
+    template<typename CountT>
+    static bool save(BasicVPYLM<IdT, CountT> &model, string filename) {
+        BasicFlatVPYLM flat;
+        flat.freeze(model);
+        return flat.save(filename);
+    }
+    // maps the file; false if it cannot be opened, and throws if it is not a flat model with ids of this width
+    bool load(string filename) {
+        unload();
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(Header)) {
+            ::close(fd);
+            throw std::runtime_error(filename + " is not a flat model file");
+        }
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            throw std::runtime_error("failed to map " + filename);
+        }
+        _data = data;
+        _size = st.st_size;
+        _mapped = true;
+        try {
+            attach();
+        } catch (...) {
+            unload();
+            throw;
+        }
+        return true;
+    }
+    void unload() {
+        if (_mapped) {
+            munmap(_data, _size);
+        }
+        _buffer.clear();
+        _buffer.shrink_to_fit();
+        _data = NULL;
+        _size = 0;
+        _mapped = false;
+    }
+    bool is_loaded() const {
+        return _data != NULL;
+    }
+    // same walk as `BasicVPYLM::compute_Pw_given_h`
+    double compute_Pw_given_h(IdT token_id, const vector<IdT> &context_token_ids) const {
+        return compute_Pw_given_context(token_id, BasicContextView<IdT>(context_token_ids));
+    }
+    // `context` is read by `size()` and `recent(n)`, see `BasicScoringState`
+    template<typename ContextT>
+    double compute_Pw_given_context(IdT token_id, const ContextT &context) const {
+        long index = 0;
+        // censoring if stop prob below this value
+        double eps = 1e-24;
+        double parent_pw = _header->g0;
+        double beta_stop = _header->beta_stop;
+        double beta_pass = _header->beta_pass;
+        double p_pass = 1;
+        double pw_h = 0;
+        int depth = 0;
+        while (index >= 0) {
+            const Node &node = _nodes[index];
+            double pw = compute_Pw_with_parent_Pw(node, depth, token_id, parent_pw);
+            double p_stop = (node.stop_count + beta_stop) / (node.stop_count + node.pass_count + beta_stop + beta_pass) * p_pass;
+            p_pass *= (node.pass_count + beta_pass) / (node.stop_count + node.pass_count + beta_stop + beta_pass);
+            pw_h += pw * p_stop;
+            parent_pw = pw;
+            if (p_stop <= eps) {
+                return pw_h;
+            }
+            if (depth < context.size()) {
+                index = find_child(node, context.recent(depth));
+            } else {
+                if (context.is_truncated() && node.num_children > 0) {
+                    throw ScoringStateTooShort();
+                }
+                index = -1;
+            }
+            depth++;
+        }
+        // beyond the tree: sum_k p_pass * r_stop * r_pass^k = p_pass, all with Pw of the deepest node
+        pw_h += parent_pw * p_pass;
+        return pw_h;
+    }
+    // log Pw of `token_id` after the context of `state`, which `next_state` receives extended by `token_id`
+    double score(const BasicScoringState<IdT> &state, IdT token_id, BasicScoringState<IdT> &next_state) const {
+        double pw_h = compute_Pw_given_context(token_id, state);
+        next_state.extend(state, token_id);
+        return log(pw_h);
+    }
+    double compute_log_Pw(const vector<IdT> &token_ids) const {
+        if (token_ids.size() == 0) {
+            return 0;
+        }
+        double sum_pw_h = 0;
+        vector<IdT> context_token_ids(token_ids.begin(), token_ids.begin() + 1);
+        for (int t=1; t<token_ids.size(); ++t) {
+            IdT token_id = token_ids[t];
+            double pw_h = compute_Pw_given_h(token_id, context_token_ids);
+            sum_pw_h += log(pw_h);
+            context_token_ids.push_back(token_id);
+        }
+        return sum_pw_h;
+    }
+    double compute_log2_Pw(const vector<IdT> &token_ids) const {
+        if (token_ids.size() == 0) {
+            return 0;
+        }
+        double sum_pw_h = 0;
+        vector<IdT> context_token_ids(token_ids.begin(), token_ids.begin() + 1);
+        for (int t=1; t<token_ids.size(); ++t) {
+            IdT token_id = token_ids[t];
+            double pw_h = compute_Pw_given_h(token_id, context_token_ids);
+            sum_pw_h += log2(pw_h);
+            context_token_ids.push_back(token_id);
+        }
+        return sum_pw_h;
+    }
+    // as `BasicVPYLM::get_num_nodes`, without the root
+    int get_num_nodes() const {
+        return _header->num_nodes - 1;
+    }
+    size_t get_num_bytes() const {
+        return _size;
+    }
+};
+
+using FlatVPYLM = BasicFlatVPYLM<id>;
@@ -33,12 +33,19 @@ struct HashMapEqualTo
     }
 };
 
+/// malloc-based allocation policy; `size` is the size passed to allocate
+struct HashMapMalloc
+{
+    static void* allocate(size_t size) { return malloc(size); }
+    static void deallocate(void* ptr, size_t size) { free(ptr); }
+};
+
 /// A cache-friendly hash table with open addressing, linear probing and power-of-two capacity
-template <typename KeyT, typename ValueT, typename HashT = std::hash<KeyT>, typename CompT = HashMapEqualTo<KeyT>>
+template <typename KeyT, typename ValueT, typename HashT = std::hash<KeyT>, typename CompT = HashMapEqualTo<KeyT>, typename AllocT = HashMapMalloc>
 class HashMap
 {
 private:
-    using MyType = HashMap<KeyT, ValueT, HashT, CompT>;
+    using MyType = HashMap<KeyT, ValueT, HashT, CompT, AllocT>;
     using PairT = std::pair<KeyT, ValueT>;
 public:
     using size_type       = size_t;
@@ -221,8 +228,8 @@ public:
                 _pairs[bucket].~PairT();
             }
         }
-        free(_states);
-        free(_pairs);
+        AllocT::deallocate(_states, _num_buckets * sizeof(State));
+        AllocT::deallocate(_pairs, _num_buckets * sizeof(PairT));
     }
 
     void swap(HashMap& other)
@@ -475,12 +482,12 @@ public:
         size_t num_buckets = 4;
         while (num_buckets < required_buckets) { num_buckets *= 2; }
 
-        auto new_states = (State*)malloc(num_buckets * sizeof(State));
-        auto new_pairs  = (PairT*)malloc(num_buckets * sizeof(PairT));
+        auto new_states = (State*)AllocT::allocate(num_buckets * sizeof(State));
+        auto new_pairs  = (PairT*)AllocT::allocate(num_buckets * sizeof(PairT));
 
         if (!new_states || !new_pairs) {
-            free(new_states);
-            free(new_pairs);
+            AllocT::deallocate(new_states, num_buckets * sizeof(State));
+            AllocT::deallocate(new_pairs, num_buckets * sizeof(PairT));
             throw std::bad_alloc();
         }
 
@@ -516,8 +523,8 @@ public:
 
         //DCHECK_EQ_F(old_num_filled, _num_filled);
 
-        free(old_states);
-        free(old_pairs);
+        AllocT::deallocate(old_states, old_num_buckets * sizeof(State));
+        AllocT::deallocate(old_pairs, old_num_buckets * sizeof(PairT));
     }
 
 private:
@@ -623,16 +630,16 @@ public:
 } // namespace emilib
 
 namespace boost { namespace serialization {
-template<class Archive, typename KeyT, typename ValueT, typename HashT = std::hash<KeyT>, typename CompT = emilib::HashMapEqualTo<KeyT>>
-void save(Archive &archive, const emilib::HashMap<KeyT, ValueT, HashT, CompT> &hmap, unsigned int version) {
+template<class Archive, typename KeyT, typename ValueT, typename HashT = std::hash<KeyT>, typename CompT = emilib::HashMapEqualTo<KeyT>, typename AllocT = emilib::HashMapMalloc>
+void save(Archive &archive, const emilib::HashMap<KeyT, ValueT, HashT, CompT, AllocT> &hmap, unsigned int version) {
     archive & hmap.size();
     for(auto itr = hmap.begin();itr != hmap.end();itr++){
         archive & itr->first;
         archive & itr->second;
     }
 }
-template<class Archive, typename KeyT, typename ValueT, typename HashT = std::hash<KeyT>, typename CompT = emilib::HashMapEqualTo<KeyT>>
-void load(Archive &archive, emilib::HashMap<KeyT, ValueT, HashT, CompT> &hmap, unsigned int version) {
+template<class Archive, typename KeyT, typename ValueT, typename HashT = std::hash<KeyT>, typename CompT = emilib::HashMapEqualTo<KeyT>, typename AllocT = emilib::HashMapMalloc>
+void load(Archive &archive, emilib::HashMap<KeyT, ValueT, HashT, CompT, AllocT> &hmap, unsigned int version) {
     size_t map_size = 0;
     archive & map_size;
     hmap.clear();
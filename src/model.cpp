@@ -1,11 +1,18 @@
 #include <boost/python.hpp>
 #include <boost/format.hpp>
+#include <atomic>
 #include <iostream>
 #include <string>
 #include <unordered_map> 
 #include "node.hpp"
 #include "vpylm.hpp"
+#include "flat_vpylm.hpp"
+#include "quantized_vpylm.hpp"
+#include "scoring_state.hpp"
+#include "batch_scorer.hpp"
 #include "vocab.hpp"
+#include "thread_pool.hpp"
+#include "scheduler.hpp"
 using namespace boost;
 
 void split_word_by(const wstring &str, wchar_t delim, vector<wstring> &elems) {
@@ -26,6 +33,27 @@ void split_word_by(const wstring &str, wchar_t delim, vector<wstring> &elems) {
     }
 }
 
+// lets other Python threads run while alive; the model must not be used by them meanwhile
+// a no-op without an interpreter holding the GIL, e.g. in the benchmark
+class ScopedGILRelease {
+private:
+    PyThreadState *_state;
+public:
+    ScopedGILRelease() {
+        _state = NULL;
+        if (Py_IsInitialized() && PyGILState_Check()) {
+            _state = PyEval_SaveThread();
+        }
+    }
+    ScopedGILRelease(const ScopedGILRelease &) = delete;
+    ScopedGILRelease &operator=(const ScopedGILRelease &) = delete;
+    ~ScopedGILRelease() {
+        if (_state) {
+            PyEval_RestoreThread(_state);
+        }
+    }
+};
+
 template<class T>
 python::list list_from_vector(vector<T> &vec) {  
      python::list list;
@@ -37,6 +65,14 @@ python::list list_from_vector(vector<T> &vec) {
      return list;
 }
 
+// a chain of Gibbs sampling besides the first one; it has its own tree and depths over the same training data
+struct Chain {
+    VPYLM *_vpylm;
+    vector<vector<int>> _prev_depths_for_data;
+    vector<int> _rand_indices;
+    bool _gibbs_first_addition;
+};
+
 class PyVPYLM {
 public:
     VPYLM *_vpylm;
@@ -46,9 +82,32 @@ public:
     vector<vector<int>> _prev_depths_for_data;
     vector<int> _rand_indices;
     // statistics
-    unordered_map<id, int> _word_count;
+    vector<int> _word_count;    // indexed by token id
+    int _num_types_of_words;
     int _sum_word_count;
     bool _gibbs_first_addition;
+    // parallel sweeps
+    ThreadPool *_pool;                      // NULL for serial sweeps
+    WorkStealingScheduler *_scheduler;      // batches of sentences for the threads of `_pool`
+    vector<VPYLM::TreeDelta*> _deltas;      // one per worker
+    // a customer a parallel sweep unseats (count -1) or seats (1) at `depth`
+    struct Seating {
+        int data_index;
+        int token_t_index;
+        int depth;
+        int count;
+    };
+    vector<vector<Seating>> _seating_groups;    // of the moves under each child of the root, see `_seat_block`
+    int _sync_interval;                     // num of sentences between two synchronizations
+    bool _hogwild;                          // threads seat into the shared tree instead
+    NodeLockTable *_node_locks;
+    ContentionStats _contention_stats;      // summed over the hogwild sweeps so far
+    // independent chains after the first one (`_vpylm`), whose predictions are averaged when scoring
+    vector<Chain*> _chains;
+    FlatVPYLM *_flat;                       // frozen or memory-mapped model scoring in place of the chains
+    QuantizedVPYLM *_quantized;             // quantized model scoring in place of the chains
+    BatchScorer _batch_scorer;
+    int _context_cache_num_entries;         // entries of the context cache of every chain, 0 if disabled
     PyVPYLM() {
         setlocale(LC_CTYPE, "ja_JP.UTF-8");
         ios_base::sync_with_stdio(false);
@@ -61,9 +120,24 @@ public:
         _vpylm = new VPYLM();
         _vocab = new Vocab();
         _gibbs_first_addition = true;
+        _pool = NULL;
+        _scheduler = new WorkStealingScheduler(1);
+        _flat = NULL;
+        _quantized = NULL;
+        _sync_interval = VPYLM_SYNC_INTERVAL;
+        _hogwild = false;
+        _node_locks = NULL;
+        _num_types_of_words = 0;
         _sum_word_count = 0;
+        _context_cache_num_entries = 0;
     }
     ~PyVPYLM() {
+        set_num_threads(1);
+        set_num_chains(1);
+        delete _scheduler;
+        delete _flat;
+        delete _quantized;
+        delete _node_locks;
         delete _vpylm;
         delete _vocab;
     }
@@ -82,7 +156,7 @@ public:
             rand_indices.push_back(i);
         }
         int split = lines.size() * split_ratio;
-        shuffle(rand_indices.begin(), rand_indices.end(), sampler::mt);
+        shuffle(rand_indices.begin(), rand_indices.end(), sampler::rng);
         for (int i=0; i<rand_indices.size(); ++i) {
             wstring &sentence = lines[rand_indices[i]];
             if (i < split) {
@@ -111,6 +185,12 @@ public:
                 }
                 id token_id = _vocab->add_string(word_str);
                 words.push_back(token_id);
+                if (token_id >= _word_count.size()) {
+                    _word_count.resize(token_id + 1, 0);
+                }
+                if (_word_count[token_id] == 0) {
+                    _num_types_of_words += 1;
+                }
                 _word_count[token_id] += 1;
                 _sum_word_count += 1;
             }
@@ -127,13 +207,16 @@ public:
     }
     void set_g0(double g0) {
         _vpylm->_g0 = g0;
+        for (Chain *chain : _chains) {
+            chain->_vpylm->_g0 = g0;
+        }
     }
     void set_seed(int seed) {
-        sampler::mt.seed(seed);
+        sampler::set_seed(seed);
     }
     void load(string dir) {
         _vocab->load(dir+"/vpylm.vocab");
-        if (_vpylm->load(dir+"/vpylm.model")) {
+        if (_vpylm->load(dir+"/vpylm.model", &_vocab->get_loaded_token_ids())) {
             _gibbs_first_addition = false;
         }
     }
@@ -141,29 +224,498 @@ public:
         _vocab->save(dir+"/vpylm.vocab");
         _vpylm->save(dir+"/vpylm.model");
     }
+    // the first chain in the flat format of `FlatVPYLM`, next to the vocabulary
+    void save_flat(string dir) {
+        _vocab->save(dir+"/vpylm.vocab");
+        FlatVPYLM::save(*_vpylm, dir+"/vpylm.flat");
+    }
+    // maps a model saved by `save_flat` for scoring only; call it before adding data, so that token ids stay those of the file
+    bool load_flat(string dir) {
+        if (_vocab->num_tokens() > 2) {
+            throw std::runtime_error("load_flat needs an empty vocabulary; call it before loading data");
+        }
+        _vocab->load(dir+"/vpylm.vocab");
+        if (_vocab->get_loaded_token_ids().empty() == false) {
+            throw std::runtime_error("the vocabulary of the flat model is of an older format");
+        }
+        FlatVPYLM *flat = new FlatVPYLM();
+        if (flat->load(dir+"/vpylm.flat") == false) {
+            delete flat;
+            return false;
+        }
+        unfreeze();
+        _flat = flat;
+        return true;
+    }
+    // the first chain as precomputed probabilities with codes of `num_bits` (8 or 16), next to the vocabulary
+    void save_quantized(string dir, int num_bits) {
+        _vocab->save(dir+"/vpylm.vocab");
+        QuantizedVPYLM::save(*_vpylm, num_bits, dir+"/vpylm.qnt");
+    }
+    // maps a model saved by `save_quantized` for scoring only, as `load_flat` does
+    bool load_quantized(string dir) {
+        if (_vocab->num_tokens() > 2) {
+            throw std::runtime_error("load_quantized needs an empty vocabulary; call it before loading data");
+        }
+        _vocab->load(dir+"/vpylm.vocab");
+        if (_vocab->get_loaded_token_ids().empty() == false) {
+            throw std::runtime_error("the vocabulary of the quantized model is of an older format");
+        }
+        QuantizedVPYLM *quantized = new QuantizedVPYLM();
+        if (quantized->load(dir+"/vpylm.qnt") == false) {
+            delete quantized;
+            return false;
+        }
+        unfreeze();
+        _quantized = quantized;
+        return true;
+    }
+    // scores with a compact immutable copy of the first chain until `unfreeze`
+    void freeze() {
+        FlatVPYLM *flat = new FlatVPYLM();
+        flat->freeze(*_vpylm);
+        unfreeze();
+        _flat = flat;
+    }
+    // as `freeze` with the probabilities of the first chain quantized to codes of `num_bits` (8 or 16)
+    void quantize(int num_bits) {
+        QuantizedVPYLM *quantized = new QuantizedVPYLM();
+        try {
+            quantized->quantize(*_vpylm, num_bits);
+        } catch (...) {
+            delete quantized;
+            throw;
+        }
+        unfreeze();
+        _quantized = quantized;
+    }
+    void unfreeze() {
+        delete _flat;
+        _flat = NULL;
+        delete _quantized;
+        _quantized = NULL;
+    }
+    void _check_trainable() {
+        if (_flat != NULL || _quantized != NULL) {
+            throw std::runtime_error("a frozen, quantized or memory-mapped model is read-only; call unfreeze first");
+        }
+    }
+    // folds the contexts of least relative entropy into their parents until the flat form of every chain takes at
+    // most `max_num_bytes`; sampling goes on from the pruned trees, and the test perplexity is reported if there is test data
+    python::dict prune(size_t max_num_bytes) {
+        _check_trainable();
+        python::dict result;
+        result["num_nodes_before"] = _vpylm->get_num_nodes();
+        result["num_bytes_before"] = FlatVPYLM::get_num_bytes_of(*_vpylm);
+        if (_dataset_test.size() > 0) {
+            result["perplexity_before"] = compute_perplexity_test();
+        }
+        int num_removed_nodes = FlatVPYLM::prune(*_vpylm, max_num_bytes);
+        _update_prev_depths_after_pruning(_vpylm, _prev_depths_for_data, _gibbs_first_addition);
+        for (Chain *chain : _chains) {
+            num_removed_nodes += FlatVPYLM::prune(*chain->_vpylm, max_num_bytes);
+            _update_prev_depths_after_pruning(chain->_vpylm, chain->_prev_depths_for_data, chain->_gibbs_first_addition);
+        }
+        result["num_removed_nodes"] = num_removed_nodes;
+        result["num_nodes_after"] = _vpylm->get_num_nodes();
+        result["num_bytes_after"] = FlatVPYLM::get_num_bytes_of(*_vpylm);
+        if (_dataset_test.size() > 0) {
+            result["perplexity_after"] = compute_perplexity_test();
+        }
+        return result;
+    }
+    // customers of a folded node were moved up to the deepest node left on their context path
+    void _update_prev_depths_after_pruning(VPYLM *vpylm, vector<vector<int>> &prev_depths_for_data, bool gibbs_first_addition) {
+        if (gibbs_first_addition) {
+            return;
+        }
+        for (int data_index=0; data_index<_dataset_train.size(); ++data_index) {
+            vector<id> &token_ids = _dataset_train[data_index];
+            vector<int> &prev_depths = prev_depths_for_data[data_index];
+            for (int token_t_index=1; token_t_index<token_ids.size(); ++token_t_index) {
+                if (prev_depths[token_t_index] <= 0) {
+                    continue;
+                }
+                VPYLM::Node *node = vpylm->find_node_by_tracing_back_context(token_ids, token_t_index, prev_depths[token_t_index], false, true);
+                prev_depths[token_t_index] = node->_depth;
+            }
+        }
+    }
     void perform_gibbs_sampling() {
+        _check_trainable();
         if (_rand_indices.size() != _dataset_train.size()) {
             _rand_indices.clear();
             for (int data_index=0; data_index<_dataset_train.size(); ++data_index) {
                 _rand_indices.push_back(data_index);
             }
         }
-        shuffle(_rand_indices.begin(), _rand_indices.end(), sampler::mt);
+        if (_chains.size() > 0) {
+            _perform_multi_chain_gibbs_sampling();
+            return;
+        }
+        shuffle(_rand_indices.begin(), _rand_indices.end(), sampler::rng);
+        if (_pool != NULL) {
+            if (_hogwild) {
+                _perform_hogwild_gibbs_sampling();
+            } else {
+                _perform_parallel_gibbs_sampling();
+            }
+            _gibbs_first_addition = false;
+            return;
+        }
+        _perform_serial_gibbs_sampling(_vpylm, _prev_depths_for_data, _rand_indices, _gibbs_first_addition);
+        _gibbs_first_addition = false;
+    }
+    void _perform_serial_gibbs_sampling(VPYLM *vpylm, vector<vector<int>> &prev_depths_for_data, vector<int> &rand_indices, bool gibbs_first_addition) {
         for (int n=0; n<_dataset_train.size(); ++n) {
-            int data_index = _rand_indices[n];
+            int data_index = rand_indices[n];
             vector<id> &token_ids = _dataset_train[data_index];
-            vector<int> &prev_depths = _prev_depths_for_data[data_index];
+            vector<int> &prev_depths = prev_depths_for_data[data_index];
             for (int token_t_index=1; token_t_index<token_ids.size(); ++token_t_index) {
-                if (_gibbs_first_addition == false) {
+                if (gibbs_first_addition == false) {
                     int prev_depth = prev_depths[token_t_index];
-                    _vpylm->remove_customer_at_timestep(token_ids, token_t_index, prev_depth);
+                    vpylm->remove_customer_at_timestep(token_ids, token_t_index, prev_depth);
                 }
-                int new_depth = _vpylm->sample_depth_at_timestep(token_ids, token_t_index);
-                _vpylm->add_customer_at_timestep(token_ids, token_t_index, new_depth);
+                int new_depth = vpylm->sample_depth_at_timestep(token_ids, token_t_index);
+                vpylm->add_customer_at_timestep(token_ids, token_t_index, new_depth);
                 prev_depths[token_t_index] = new_depth;
             }
         }
-        _gibbs_first_addition = false;
+    }
+    // every chain sweeps serially in its own order with its own random stream; the threads take one chain at a time
+    // the result does not depend on the number of threads
+    void _perform_multi_chain_gibbs_sampling() {
+        uint64_t seed = sampler::rng();
+        // one batch per chain
+        vector<int> costs(_chains.size() + 1, 1);
+        _scheduler->run(_pool, costs, 1, [&](int worker, int chain_index, int begin, int end) {
+            sampler::engine engine = sampler::make_engine(seed, chain_index);
+            sampler::EngineScope engine_scope(&engine);
+            if (chain_index == 0) {
+                shuffle(_rand_indices.begin(), _rand_indices.end(), engine);
+                _perform_serial_gibbs_sampling(_vpylm, _prev_depths_for_data, _rand_indices, _gibbs_first_addition);
+                _gibbs_first_addition = false;
+                return;
+            }
+            Chain *chain = _chains[chain_index - 1];
+            if (chain->_rand_indices.size() != _dataset_train.size()) {
+                chain->_rand_indices.clear();
+                for (int data_index=0; data_index<_dataset_train.size(); ++data_index) {
+                    chain->_rand_indices.push_back(data_index);
+                }
+            }
+            // chains added after `prepare`
+            if (chain->_prev_depths_for_data.size() != _dataset_train.size()) {
+                chain->_prev_depths_for_data.clear();
+                for (auto &token_ids : _dataset_train) {
+                    chain->_prev_depths_for_data.push_back(vector<int>(token_ids.size(), -1));
+                }
+            }
+            shuffle(chain->_rand_indices.begin(), chain->_rand_indices.end(), engine);
+            _perform_serial_gibbs_sampling(chain->_vpylm, chain->_prev_depths_for_data, chain->_rand_indices, chain->_gibbs_first_addition);
+            chain->_gibbs_first_addition = false;
+        });
+    }
+    // AD-LDA style sweep; the depths of blocks of `_sync_interval` sentences are resampled in parallel against the
+    // tree as of the start of the block, and the moves are seated into the tree at the end of the block
+    // the block is resampled in batches of about VPYLM_BATCH_NUM_TOKENS tokens, each unseating and seating its own
+    // customers in a delta and drawing from its own stream, so the result does not depend on which thread takes a batch
+    // the tree keeps the size of every table, which the counts of a delta do not tell, so the moves are seated again
+    // with the tree's own sampler, in parallel over the subtrees of the root, see `_seat_block`
+    void _perform_parallel_gibbs_sampling() {
+        int num_threads = _pool->get_num_threads();
+        uint64_t seed = sampler::rng();
+        uint64_t seating_seed = sampler::rng();
+        vector<vector<double>> sampling_tables(num_threads);
+        vector<vector<Node*>> paths(num_threads);
+        vector<vector<Seating>> batch_seatings;
+        vector<int> costs;
+        long num_batches = 0;       // of the blocks so far
+        long num_seating_batches = 0;
+        int max_depth = _vpylm->get_depth();
+        for (int begin=0; begin<_rand_indices.size(); begin+=_sync_interval) {
+            int end = std::min<int>(begin + _sync_interval, _rand_indices.size());
+            // workers only read the hyperparameters of existing nodes, which must not grow meanwhile
+            _vpylm->init_hyperparams_at_depth_if_needed(max_depth);
+            costs.clear();
+            for (int n=begin; n<end; ++n) {
+                costs.push_back(_dataset_train[_rand_indices[n]].size() - 1);
+            }
+            batch_seatings.resize(costs.size());
+            int num_block_batches = _scheduler->run(_pool, costs, VPYLM_BATCH_NUM_TOKENS, [&](int worker, int batch, int batch_begin, int batch_end) {
+                sampler::engine engine = sampler::make_engine(seed, num_batches + batch);
+                sampler::EngineScope engine_scope(&engine);
+                VPYLM::TreeDelta *delta = _deltas[worker];
+                SlabAllocator::Scope allocator_scope(&delta->_allocator);
+                vector<Node*> &path = paths[worker];
+                vector<Seating> &seatings = batch_seatings[batch];
+                delta->clear();
+                seatings.clear();
+                for (int n=begin+batch_begin; n<begin+batch_end; ++n) {
+                    vector<id> &token_ids = _dataset_train[_rand_indices[n]];
+                    vector<int> &prev_depths = _prev_depths_for_data[_rand_indices[n]];
+                    for (int token_t_index=1; token_t_index<token_ids.size(); ++token_t_index) {
+                        if (_gibbs_first_addition == false) {
+                            int prev_depth = prev_depths[token_t_index];
+                            _vpylm->find_path_of_customer(token_ids, token_t_index, prev_depth, path);
+                            delta->remove_customer(path, prev_depth, token_ids[token_t_index]);
+                            seatings.push_back(Seating{_rand_indices[n], token_t_index, prev_depth, -1});
+                        }
+                        int new_depth = _vpylm->sample_depth_at_timestep(token_ids, token_t_index, sampling_tables[worker], &path, delta);
+                        delta->add_customer(path, new_depth, token_ids[token_t_index]);
+                        seatings.push_back(Seating{_rand_indices[n], token_t_index, new_depth, 1});
+                        prev_depths[token_t_index] = new_depth;
+                    }
+                }
+            });
+            num_batches += num_block_batches;
+            num_seating_batches += _seat_block(batch_seatings, num_block_batches, seating_seed, num_seating_batches, max_depth);
+        }
+        // nodes emptied while the root was deferred
+        _vpylm->remove_empty_nodes();
+    }
+    // seats the moves of the batches of a block into the tree; all those under one child of the root are taken by
+    // one thread in the order of the batches, while the proxy customers and pass counts they would send to the root
+    // are deferred and applied afterwards by this thread together with the customers of the root itself
+    // returns the number of batches drawing from `seed`
+    // `max_depth` is raised to the deepest seating
+    int _seat_block(vector<vector<Seating>> &batch_seatings, int num_block_batches, uint64_t seed, long num_seed_batches, int &max_depth) {
+        int num_threads = _pool->get_num_threads();
+        hashmap<id, int> group_of_context;
+        vector<vector<Seating>> &groups = _seating_groups;
+        vector<Seating> root_seatings;
+        int num_groups = 0;
+        for (int batch=0; batch<num_block_batches; ++batch) {
+            for (const Seating &seating : batch_seatings[batch]) {
+                max_depth = std::max(max_depth, seating.depth);
+                if (seating.depth == 0) {
+                    root_seatings.push_back(seating);
+                    continue;
+                }
+                vector<id> &token_ids = _dataset_train[seating.data_index];
+                id context_token_id = token_ids[seating.token_t_index - 1];
+                auto itr = group_of_context.find(context_token_id);
+                int group;
+                if (itr == group_of_context.end()) {
+                    group = num_groups++;
+                    group_of_context[context_token_id] = group;
+                    if (groups.size() < num_groups) {
+                        groups.resize(num_groups);
+                    }
+                    groups[group].clear();
+                    // children of the root are not added while threads read it
+                    _vpylm->find_node_by_tracing_back_context(token_ids, seating.token_t_index, 1, true);
+                } else {
+                    group = itr->second;
+                }
+                groups[group].push_back(seating);
+            }
+        }
+        // parent Pw of new depths are read by every thread
+        _vpylm->init_hyperparams_at_depth_if_needed(max_depth);
+        vector<int> costs(num_groups);
+        for (int group=0; group<num_groups; ++group) {
+            costs[group] = groups[group].size();
+        }
+        vector<vector<double>> parent_pw_paths(num_threads);
+        vector<Node::RootUpdates> root_updates(num_groups);
+        int num_batches = _scheduler->run(_pool, costs, VPYLM_BATCH_NUM_TOKENS, [&](int worker, int batch, int batch_begin, int batch_end) {
+            sampler::engine engine = sampler::make_engine(seed, num_seed_batches + batch);
+            sampler::EngineScope engine_scope(&engine);
+            Node::deferred_root_updates() = &root_updates[batch];
+            for (int group=batch_begin; group<batch_end; ++group) {
+                for (const Seating &seating : groups[group]) {
+                    vector<id> &token_ids = _dataset_train[seating.data_index];
+                    if (seating.count > 0) {
+                        _vpylm->add_customer_at_timestep(token_ids, seating.token_t_index, seating.depth, parent_pw_paths[worker]);
+                    } else {
+                        _vpylm->remove_customer_at_timestep(token_ids, seating.token_t_index, seating.depth);
+                    }
+                }
+            }
+            Node::deferred_root_updates() = NULL;
+        });
+        for (int batch=0; batch<num_batches; ++batch) {
+            _vpylm->apply_root_updates(root_updates[batch]);
+        }
+        for (const Seating &seating : root_seatings) {
+            vector<id> &token_ids = _dataset_train[seating.data_index];
+            if (seating.count > 0) {
+                _vpylm->add_customer_at_timestep(token_ids, seating.token_t_index, 0);
+            } else {
+                _vpylm->remove_customer_at_timestep(token_ids, seating.token_t_index, 0);
+            }
+        }
+        return num_batches;
+    }
+    // every thread removes, samples and adds the customers of batches of sentences directly in the shared tree
+    // each node is locked while it is read or written, see `NodeLockTable`; results depend on thread timing
+    void _perform_hogwild_gibbs_sampling() {
+        int num_threads = _pool->get_num_threads();
+        uint64_t seed = sampler::rng();
+        // hyperparameters are not added while threads read them
+        int max_length = 0;
+        for (auto &token_ids : _dataset_train) {
+            max_length = std::max<int>(max_length, token_ids.size());
+        }
+        _vpylm->init_hyperparams_at_depth_if_needed(max_length);
+        if (_node_locks == NULL) {
+            _node_locks = new NodeLockTable();
+        }
+        vector<ContentionStats> stats(num_threads);
+        vector<vector<double>> sampling_tables(num_threads);
+        vector<vector<double>> parent_pw_paths(num_threads);
+        vector<int> costs;
+        for (int n=0; n<_rand_indices.size(); ++n) {
+            costs.push_back(_dataset_train[_rand_indices[n]].size() - 1);
+        }
+        _scheduler->run(_pool, costs, VPYLM_BATCH_NUM_TOKENS, [&](int worker, int batch, int begin, int end) {
+            sampler::engine engine = sampler::make_engine(seed, batch);
+            sampler::EngineScope engine_scope(&engine);
+            NodeLockTable::Scope lock_scope(_node_locks, &stats[worker]);
+            pointer_hashmap<Node, int> buffered_pass_counts;
+            Node::buffered_pass_counts() = &buffered_pass_counts;
+            int num_tokens = 0;
+            for (int n=begin; n<end; ++n) {
+                vector<id> &token_ids = _dataset_train[_rand_indices[n]];
+                vector<int> &prev_depths = _prev_depths_for_data[_rand_indices[n]];
+                for (int token_t_index=1; token_t_index<token_ids.size(); ++token_t_index) {
+                    if (_gibbs_first_addition == false) {
+                        _vpylm->remove_customer_at_timestep(token_ids, token_t_index, prev_depths[token_t_index]);
+                    }
+                    int new_depth = _vpylm->sample_depth_at_timestep(token_ids, token_t_index, sampling_tables[worker], NULL, NULL);
+                    _vpylm->add_customer_at_timestep(token_ids, token_t_index, new_depth, parent_pw_paths[worker]);
+                    prev_depths[token_t_index] = new_depth;
+                    if (++num_tokens % VPYLM_HOGWILD_FLUSH_INTERVAL == 0) {
+                        _vpylm->flush_buffered_pass_counts();
+                    }
+                }
+            }
+            _vpylm->flush_buffered_pass_counts();
+            Node::buffered_pass_counts() = NULL;
+        });
+        // deferred until no thread holds a node
+        _vpylm->remove_empty_nodes();
+        for (auto &worker_stats : stats) {
+            _contention_stats.add(worker_stats);
+        }
+    }
+    // sweeps run serially with 1
+    void set_num_threads(int num_threads) {
+        for (VPYLM::TreeDelta *delta : _deltas) {
+            delete delta;
+        }
+        _deltas.clear();
+        delete _pool;
+        _pool = NULL;
+        delete _scheduler;
+        _scheduler = new WorkStealingScheduler(std::max(1, num_threads));
+        if (num_threads > 1) {
+            _pool = new ThreadPool(num_threads);
+            for (int worker=0; worker<num_threads; ++worker) {
+                _deltas.push_back(new VPYLM::TreeDelta());
+            }
+        }
+    }
+    int get_num_threads() {
+        return _pool == NULL ? 1 : _pool->get_num_threads();
+    }
+    // chains beyond the first start from an empty tree and are seated on the next sweep; they are left out of scoring until then
+    // the first chain alone is saved, loaded, and used for generation
+    void set_num_chains(int num_chains) {
+        while (_chains.size() > 0 && _chains.size() + 1 > num_chains) {
+            delete _chains.back()->_vpylm;
+            delete _chains.back();
+            _chains.pop_back();
+        }
+        while (_chains.size() + 1 < num_chains) {
+            Chain *chain = new Chain();
+            chain->_vpylm = new VPYLM();
+            chain->_vpylm->_g0 = _vpylm->_g0;
+            chain->_vpylm->set_context_cache(_context_cache_num_entries);
+            chain->_gibbs_first_addition = true;
+            _chains.push_back(chain);
+        }
+    }
+    int get_num_chains() {
+        return _chains.size() + 1;
+    }
+    void set_sync_interval(int num_sentences) {
+        _sync_interval = std::max(1, num_sentences);
+    }
+    int get_sync_interval() {
+        return _sync_interval;
+    }
+    // parallel sweeps seat into the shared tree (true) or into per-thread deltas merged at sync points (false)
+    void set_hogwild(bool hogwild) {
+        _hogwild = hogwild;
+    }
+    bool get_hogwild() {
+        return _hogwild;
+    }
+    python::dict get_contention_stats() {
+        python::dict stats;
+        stats["num_locks"] = _contention_stats.num_locks;
+        stats["num_contended_locks"] = _contention_stats.num_contended_locks;
+        stats["num_spins"] = _contention_stats.num_spins;
+        stats["num_missing_customers"] = _contention_stats.num_missing_customers;
+        stats["num_buffered_counts"] = _contention_stats.num_buffered_counts;
+        stats["num_flushes"] = _contention_stats.num_flushes;
+        return stats;
+    }
+    void reset_contention_stats() {
+        _contention_stats.clear();
+    }
+    // per thread of parallel sweeps and scoring since the last call of `set_num_threads`
+    python::list get_scheduler_stats() {
+        python::list result;
+        for (auto &worker_stats : _scheduler->get_stats()) {
+            python::dict stats;
+            stats["busy_sec"] = worker_stats.busy_sec;
+            stats["idle_sec"] = worker_stats.idle_sec;
+            stats["num_batches"] = worker_stats.num_batches;
+            stats["num_stolen_batches"] = worker_stats.num_stolen_batches;
+            result.append(stats);
+        }
+        return result;
+    }
+    void reset_scheduler_stats() {
+        _scheduler->clear_stats();
+    }
+    // memoizes the nodes and stop probabilities reached by the last VPYLM_CONTEXT_CACHE_ORDER tokens of a context in
+    // `num_entries` entries per chain, for evaluation and generation that see the same histories over and over;
+    // 0 disables it. Every update of a tree drops its entries, so it saves nothing while sampling.
+    // frozen and quantized models do not use it
+    void set_context_cache(int num_entries) {
+        _context_cache_num_entries = std::max(0, num_entries);
+        _vpylm->set_context_cache(_context_cache_num_entries);
+        for (Chain *chain : _chains) {
+            chain->_vpylm->set_context_cache(_context_cache_num_entries);
+        }
+    }
+    // summed over the chains
+    python::dict get_context_cache_stats() {
+        ContextCacheStats sum = _vpylm->get_context_cache_stats();
+        for (Chain *chain : _chains) {
+            ContextCacheStats stats = chain->_vpylm->get_context_cache_stats();
+            sum.num_hits += stats.num_hits;
+            sum.num_misses += stats.num_misses;
+            sum.num_invalidations += stats.num_invalidations;
+        }
+        python::dict stats;
+        stats["num_entries"] = _context_cache_num_entries;
+        stats["num_hits"] = sum.num_hits;
+        stats["num_misses"] = sum.num_misses;
+        stats["num_invalidations"] = sum.num_invalidations;
+        long num_lookups = sum.num_hits + sum.num_misses;
+        stats["hit_rate"] = num_lookups == 0 ? 0.0 : (double)sum.num_hits / num_lookups;
+        return stats;
+    }
+    void reset_context_cache_stats() {
+        _vpylm->clear_context_cache_stats();
+        for (Chain *chain : _chains) {
+            chain->_vpylm->clear_context_cache_stats();
+        }
     }
     void remove_all_data() {
         for (int i=0; i<_dataset_train.size(); ++i) {
@@ -183,13 +735,19 @@ public:
         return _dataset_test.size();
     }
     int get_num_nodes() {
+        if (_flat != NULL) {
+            return _flat->get_num_nodes();
+        }
+        if (_quantized != NULL) {
+            return _quantized->get_num_nodes();
+        }
         return _vpylm->get_num_nodes();
     }
     int get_num_customers() {
         return _vpylm->get_num_customers();
     }
     int get_num_types_of_words() {
-        return _word_count.size();
+        return _num_types_of_words;
     }
     int get_num_words() {
         return _sum_word_count;
@@ -220,7 +778,11 @@ public:
         return list_from_vector(_vpylm->_theta_m);
     }
     void sample_hyperparams() {
-        _vpylm->sample_hyperparams();
+        _check_trainable();
+        _vpylm->sample_hyperparams(_pool);
+        for (Chain *chain : _chains) {
+            chain->_vpylm->sample_hyperparams(_pool);
+        }
     }
     double compute_log_Pdataset_train() {
         return _compute_log_Pdataset(_dataset_train);
@@ -229,10 +791,11 @@ public:
         return _compute_log_Pdataset(_dataset_test);
     }
     double _compute_log_Pdataset(vector<vector<id>> &dataset) {
+        vector<double> log_Pw;
+        _compute_log_Pw_of_each_data(dataset, false, log_Pw);
         double log_Pdataset = 0;
         for(int data_index=0; data_index<dataset.size(); ++data_index) {
-            vector<id> &token_ids = dataset[data_index];
-            log_Pdataset += _vpylm->compute_log_Pw(token_ids);
+            log_Pdataset += log_Pw[data_index];
         }
         return log_Pdataset;
     }
@@ -243,18 +806,167 @@ public:
         return _compute_perplexity(_dataset_test);
     }
     double _compute_perplexity(vector<vector<id>> &dataset) {
+        vector<double> log2_Pw;
+        _compute_log_Pw_of_each_data(dataset, true, log2_Pw);
         double log_Pdataset = 0;
         for(int data_index=0; data_index<dataset.size(); ++data_index) {            
             vector<id> &token_ids = dataset[data_index];
-            log_Pdataset += _vpylm->compute_log2_Pw(token_ids) / token_ids.size();
+            log_Pdataset += log2_Pw[data_index] / token_ids.size();
         }
         return pow(2.0, -log_Pdataset / (double)dataset.size());
     }
+    // log P (or log2 P) of every sentence, scored on the thread pool without the GIL
+    // callers sum them up in order, so the result is the same for any number of threads
+    void _compute_log_Pw_of_each_data(vector<vector<id>> &dataset, bool log2, vector<double> &log_Pw) {
+        log_Pw.resize(dataset.size());
+        _init_hyperparams_for_scoring();
+        ScopedGILRelease gil_release;
+        vector<int> costs;
+        for (auto &token_ids : dataset) {
+            costs.push_back(token_ids.size());
+        }
+        _scheduler->run(_pool, costs, VPYLM_BATCH_NUM_TOKENS, [&](int worker, int batch, int begin, int end) {
+            for (int data_index=begin; data_index<end; ++data_index) {
+                log_Pw[data_index] = _compute_log_Pw(dataset[data_index], log2);
+            }
+        });
+    }
+    // scoring only reads the trees once every depth has its hyperparameters
+    void _init_hyperparams_for_scoring() {
+        _vpylm->init_hyperparams_at_depth_if_needed(_vpylm->get_depth());
+        for (Chain *chain : _chains) {
+            chain->_vpylm->init_hyperparams_at_depth_if_needed(chain->_vpylm->get_depth());
+        }
+    }
+    double _compute_log_Pw(vector<id> &token_ids, bool log2) {
+        if (_flat != NULL) {
+            return log2 ? _flat->compute_log2_Pw(token_ids) : _flat->compute_log_Pw(token_ids);
+        }
+        if (_quantized != NULL) {
+            return log2 ? _quantized->compute_log2_Pw(token_ids) : _quantized->compute_log_Pw(token_ids);
+        }
+        if (_get_num_trained_chains() == 1) {
+            return log2 ? _vpylm->compute_log2_Pw(token_ids) : _vpylm->compute_log_Pw(token_ids);
+        }
+        double sum_pw_h = 0;
+        vector<id> context_token_ids(token_ids.begin(), token_ids.begin() + 1);
+        for (int t=1; t<token_ids.size(); ++t) {
+            id token_id = token_ids[t];
+            double pw_h = _compute_Pw_given_h(token_id, context_token_ids);
+            sum_pw_h += log2 ? std::log2(pw_h) : log(pw_h);
+            context_token_ids.push_back(token_id);
+        }
+        return sum_pw_h;
+    }
+    // chains swept at least once, counting the first one; a chain added by `set_num_chains` has an empty tree until its
+    // first sweep and would drag the ensemble towards g0
+    int _get_num_trained_chains() {
+        int num_chains = 1;
+        for (Chain *chain : _chains) {
+            if (chain->_gibbs_first_addition == false) {
+                num_chains++;
+            }
+        }
+        return num_chains;
+    }
+    // mean of the predictive distributions of the trained chains
+    double _compute_Pw_given_h(id token_id, vector<id> &context_token_ids) {
+        double sum_pw_h = _vpylm->compute_Pw_given_h(token_id, context_token_ids);
+        for (Chain *chain : _chains) {
+            if (chain->_gibbs_first_addition == false) {
+                sum_pw_h += chain->_vpylm->compute_Pw_given_h(token_id, context_token_ids);
+            }
+        }
+        return sum_pw_h / _get_num_trained_chains();
+    }
+    // state at the beginning of a sentence, see `score`
+    ScoringState begin_state() {
+        ScoringState state;
+        state.extend(state, ID_BOS);
+        return state;
+    }
+    // (log Pw of `word` after the context of `state`, the state extended by `word`), for extending hypotheses token by
+    // token; scores like the datasets, with the chains, frozen or quantized model
+    // throws once the context outgrows the state on a tree deeper than VPYLM_SCORING_STATE_ORDER, see `ScoringStateTooShort`
+    python::tuple score(const ScoringState &state, wstring word) {
+        ScoringState next_state;
+        double log_Pw = _score(state, _vocab->string_to_token_id(word), next_state);
+        return python::make_tuple(log_Pw, next_state);
+    }
+    double _score(const ScoringState &state, id token_id, ScoringState &next_state) {
+        if (_flat != NULL) {
+            return _flat->score(state, token_id, next_state);
+        }
+        if (_quantized != NULL) {
+            return _quantized->score(state, token_id, next_state);
+        }
+        if (_get_num_trained_chains() == 1) {
+            return _vpylm->score(state, token_id, next_state);
+        }
+        double sum_pw_h = _vpylm->compute_Pw_given_context(token_id, state);
+        for (Chain *chain : _chains) {
+            if (chain->_gibbs_first_addition == false) {
+                sum_pw_h += chain->_vpylm->compute_Pw_given_context(token_id, state);
+            }
+        }
+        next_state.extend(state, token_id);
+        return log(sum_pw_h / _get_num_trained_chains());
+    }
+    // log P of every sentence, such as the n-best hypotheses of an utterance, with prefixes shared by sentences scored once
+    // words are split by spaces and end with EOS as in the datasets; words outside the vocabulary are not added to it
+    python::list score_batch(python::list sentences) {
+        vector<vector<id>> dataset;
+        vector<wstring> word_str_array;
+        for (int i=0; i<python::len(sentences); ++i) {
+            wstring sentence = python::extract<wstring>(sentences[i]);
+            split_word_by(sentence, L' ', word_str_array);
+            vector<id> token_ids;
+            token_ids.push_back(ID_BOS);
+            for (auto &word_str : word_str_array) {
+                if (word_str.size() > 0) {
+                    token_ids.push_back(_vocab->string_to_token_id(word_str));
+                }
+            }
+            token_ids.push_back(ID_EOS);
+            dataset.push_back(token_ids);
+        }
+        vector<double> log_Pw;
+        _init_hyperparams_for_scoring();
+        try {
+            ScopedGILRelease gil_release;
+            _batch_scorer.score(dataset, [&](const ScoringState &state, id token_id, ScoringState &next_state) {
+                return _score(state, token_id, next_state);
+            }, log_Pw);
+        } catch (const ScoringStateTooShort &e) {
+            // long sentences on a tree deeper than a state reaches are scored whole, without sharing prefixes
+            _compute_log_Pw_of_each_data(dataset, false, log_Pw);
+        }
+        python::list result;
+        for (double value : log_Pw) {
+            result.append(value);
+        }
+        return result;
+    }
+    python::list get_top_k_next_tokens(python::list context_words, int k) {
+        vector<id> context_token_ids;
+        context_token_ids.push_back(ID_BOS);
+        for (int i=0; i<python::len(context_words); ++i) {
+            wstring word = python::extract<wstring>(context_words[i]);
+            context_token_ids.push_back(_vocab->string_to_token_id(word));
+        }
+        vector<pair<id, double>> top_k;
+        _vpylm->get_top_k_next_tokens(context_token_ids, k, _vocab->num_tokens(), top_k);
+        python::list result;
+        for (auto &elem : top_k) {
+            result.append(python::make_tuple(_vocab->token_id_to_string(elem.first), elem.second));
+        }
+        return result;
+    }
     wstring generate_sentence() {
         std::vector<id> context_token_ids;
         context_token_ids.push_back(ID_BOS);
         for(int n=0; n<1000; ++n) {
-            id next_id = _vpylm->sample_next_token(context_token_ids, _vocab->get_all_token_ids());
+            id next_id = _vpylm->sample_next_token(context_token_ids, _vocab->num_tokens());
             if(next_id == ID_EOS) {
                 vector<id> token_ids(context_token_ids.begin() + 1, context_token_ids.end());
                 return _vocab->token_ids_to_sentence(token_ids);
@@ -266,12 +978,29 @@ public:
 };
 
 BOOST_PYTHON_MODULE(model) {
+    python::class_<ScoringState>("scoring_state", python::init<>())
+    .def("__len__", &ScoringState::size);
     python::class_<PyVPYLM>("vpylm", python::init<>())
     .def("set_g0", &PyVPYLM::set_g0)
     .def("set_seed", &PyVPYLM::set_seed)
     .def("load_textfile", &PyVPYLM::load_textfile)
     .def("prepare", &PyVPYLM::prepare)
     .def("perform_gibbs_sampling", &PyVPYLM::perform_gibbs_sampling)
+    .def("set_num_threads", &PyVPYLM::set_num_threads)
+    .def("get_num_threads", &PyVPYLM::get_num_threads)
+    .def("set_num_chains", &PyVPYLM::set_num_chains)
+    .def("get_num_chains", &PyVPYLM::get_num_chains)
+    .def("set_sync_interval", &PyVPYLM::set_sync_interval)
+    .def("get_sync_interval", &PyVPYLM::get_sync_interval)
+    .def("set_hogwild", &PyVPYLM::set_hogwild)
+    .def("get_hogwild", &PyVPYLM::get_hogwild)
+    .def("get_contention_stats", &PyVPYLM::get_contention_stats)
+    .def("reset_contention_stats", &PyVPYLM::reset_contention_stats)
+    .def("get_scheduler_stats", &PyVPYLM::get_scheduler_stats)
+    .def("reset_scheduler_stats", &PyVPYLM::reset_scheduler_stats)
+    .def("set_context_cache", &PyVPYLM::set_context_cache)
+    .def("get_context_cache_stats", &PyVPYLM::get_context_cache_stats)
+    .def("reset_context_cache_stats", &PyVPYLM::reset_context_cache_stats)
     .def("get_num_nodes", &PyVPYLM::get_num_nodes)
     .def("get_num_customers", &PyVPYLM::get_num_customers)
     .def("get_discount_parameters", &PyVPYLM::get_discount_parameters)
@@ -290,6 +1019,18 @@ BOOST_PYTHON_MODULE(model) {
     .def("compute_perplexity_train", &PyVPYLM::compute_perplexity_train)
     .def("compute_perplexity_test", &PyVPYLM::compute_perplexity_test)
     .def("generate_sentence", &PyVPYLM::generate_sentence)
+    .def("get_top_k_next_tokens", &PyVPYLM::get_top_k_next_tokens)
+    .def("begin_state", &PyVPYLM::begin_state)
+    .def("score", &PyVPYLM::score)
+    .def("score_batch", &PyVPYLM::score_batch)
     .def("save", &PyVPYLM::save)
+    .def("save_flat", &PyVPYLM::save_flat)
+    .def("load_flat", &PyVPYLM::load_flat)
+    .def("freeze", &PyVPYLM::freeze)
+    .def("unfreeze", &PyVPYLM::unfreeze)
+    .def("quantize", &PyVPYLM::quantize)
+    .def("save_quantized", &PyVPYLM::save_quantized)
+    .def("load_quantized", &PyVPYLM::load_quantized)
+    .def("prune", &PyVPYLM::prune)
     .def("load", &PyVPYLM::load);
 }
\ No newline at end of file
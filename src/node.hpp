@@ -1,5 +1,6 @@
 #pragma once
 #include <boost/serialization/serialization.hpp>
+#include <boost/serialization/version.hpp>
 #include <boost/archive/binary_iarchive.hpp>
 #include <boost/archive/binary_oarchive.hpp>
 #include <boost/serialization/unordered_map.hpp>
@@ -9,69 +10,135 @@
 #include <string>
 #include <vector>
 #include <cassert>
+#include <limits>
+#include <stdexcept>
 #include <fstream>
 #include "common.hpp"
 #include "sampler.hpp"
+#include "tables.hpp"
+#include "small_map.hpp"
+#include "node_lock.hpp"
 using namespace std;
 
-class Node {
+template<typename IdT, typename CountT>
+class BasicNode {
+public:
+    using table_record = basic_table_record<CountT>;
 private:
-    bool add_customer_to_table(id token_id, int table_k, double g0, vector<double> &d_m, vector<double> &theta_m) {
+    // seats a customer of `token_id` in this restaurant only; true if it opened a new table
+    bool seat_customer(IdT token_id, double parent_Pw, double d_u, double theta_u) {
+        NodeLock lock(this);
         auto itr = _arrangement.find(token_id);
-        if (itr == _arrangement.end()) {
-            return add_customer_to_new_table(token_id, g0, d_m, theta_m);
-        } // else
-        vector<int> &num_customers_at_table = itr->second;
-        num_customers_at_table[table_k]++;
         _num_customers++;
+        /* add customer to new table */
+        if (itr == _arrangement.end()) {
+            _arrangement[token_id].add_customer_to_new_table();
+            _num_tables++;
+            return true;
+        }
+        /* add customer to existing table */
+        // tables grouped by num of customer
+        table_record &tables = itr->second;
+        // for normalizing prob; sum_k (c_uwk - d_u) = c_uw - d_u * t_uw since every table has c_uwk >= 1 > d_u
+        double sum = std::max(0.0, tables.num_customers() - d_u * tables.num_tables());
+        double t_u = _num_tables;
+        sum += (theta_u + d_u * t_u) * parent_Pw;
+        double normalizer = 1.0 / sum;
+        double bernoulli = sampler::uniform(0, 1);
+        double stack = 0;
+        // calculate probabiliry of adding customer to all of table serving `w`
+        for (int k=0; k<tables.num_bins(); ++k) {
+            stack += tables.bin_tables(k) * std::max(0.0, tables.bin_size(k) - d_u) * normalizer;
+            if (bernoulli <= stack) {
+                tables.add_customer_to_table(k);
+                return false;
+            }
+        }
+        tables.add_customer_to_new_table();
+        _num_tables++;
         return true;
     }
-    bool add_customer_to_new_table(id token_id, double g0, vector<double> &d_m, vector<double> &theta_m) {
+    // removes a customer of `token_id` from this restaurant only; true if it closed a table
+    bool unseat_customer(IdT token_id) {
+        NodeLock lock(this);
         auto itr = _arrangement.find(token_id);
         if (itr == _arrangement.end()) {
-            vector<int> tables = {1};
-            _arrangement[token_id] = tables;
-        } else {
-            vector<int> &num_customers_at_table = itr->second;
-            num_customers_at_table.push_back(1);
+            // only when several threads share the tree
+            NodeLockTable::current_stats()->num_missing_customers++;
+            return false;
         }
-        _num_tables++;
-        _num_customers++;
-        if (_parent != NULL) {
-            // send dummy customer to parent node(restraunt)
-            _parent->add_customer(token_id, g0, d_m, theta_m, false);
+        // tables grouped by num of customer
+        table_record &tables = itr->second;
+        // for normalizer; c_uw
+        double sum = tables.num_customers();
+        double normalizer = 1.0 / sum;
+        double bernoulli = sampler::uniform(0, 1);
+        double stack = 0;
+        // c_{u w k}; num of customer at table k of restaurant u serving word w
+        int table_k = tables.num_bins() - 1;
+        for (int k=0; k<tables.num_bins(); ++k) {
+            stack += tables.bin_tables(k) * tables.bin_size(k) * normalizer;
+            if (bernoulli <= stack) {
+                table_k = k;
+                break;
+            }
+        }
+        _num_customers--;
+        if (tables.remove_customer_from_table(table_k) == false) {
+            return false;
+        }
+        _num_tables--;
+        if (tables.size() == 0) {
+            _arrangement.erase(token_id);
         }
         return true;
     }
-    bool remove_customer_from_table(id token_id, int table_k) {
-        auto itr = _arrangement.find(token_id);
-        vector<int> &num_customers_at_table = itr->second;
-        num_customers_at_table[table_k]--;
-        _num_customers--;
-        if (num_customers_at_table[table_k] == 0) {
-            if (_parent != NULL) {
-                _parent->remove_customer(token_id, false);
-            }
-            num_customers_at_table.erase(num_customers_at_table.begin() + table_k);
-            _num_tables--;
-            if (num_customers_at_table.size() == 0) {
-                _arrangement.erase(token_id);
-            }
+    // pass counts of shallow nodes are kept back by threads sharing the tree, see `buffered_pass_counts`
+    bool buffer_pass_count(int count) {
+        pointer_hashmap<BasicNode, int> *buffer = buffered_pass_counts();
+        if (buffer == NULL || _depth >= VPYLM_HOGWILD_BUFFERED_DEPTH) {
+            return false;
+        }
+        (*buffer)[this] += count;
+        NodeLockTable::current_stats()->num_buffered_counts++;
+        return true;
+    }
+    // proxy customers a node of depth 1 sends to the root are left to a single thread, see `deferred_root_updates`
+    bool defer_root_customer(IdT token_id, int count) {
+        RootUpdates *updates = deferred_root_updates();
+        if (updates == NULL || _depth != 1) {
+            return false;
+        }
+        updates->customers.push_back(std::make_pair(token_id, count));
+        return true;
+    }
+    bool defer_root_pass_count(int count) {
+        RootUpdates *updates = deferred_root_updates();
+        if (updates == NULL || _parent != NULL) {
+            return false;
         }
+        updates->pass_count += count;
         return true;
     }
 public:
-    hashmap<id, Node*> _children;
-    hashmap<id, vector<int>> _arrangement;
-    Node *_parent;
+    SmallMap<IdT, BasicNode*, VPYLM_INLINE_CHILDREN> _children;
+    SmallMap<IdT, table_record, VPYLM_INLINE_WORDS> _arrangement;
+    BasicNode *_parent;
     int _num_tables;
     int _num_customers;
     int _stop_count;
     int _pass_count;
     int _depth;
-    id _token_id;
+    IdT _token_id;
 
-    Node(id token_id=0) {
+    // nodes come from the slab allocator of the current thread, see `SlabAllocator::Scope`
+    static void *operator new(size_t size) {
+        return SlabAllocator::allocate(size);
+    }
+    static void operator delete(void *ptr, size_t size) {
+        SlabAllocator::deallocate(ptr, size);
+    }
+    BasicNode(IdT token_id=0) {
         _num_tables = 0;
         _num_customers = 0;
         _stop_count = 0;
@@ -82,7 +149,7 @@ public:
     bool parent_exists() {
         return !(_parent == NULL);
     }
-    bool child_exists(id token_id) {
+    bool child_exists(IdT token_id) {
         return !(_children.find(token_id) == _children.end());
     }
     bool need_to_remove_from_parent() {
@@ -94,24 +161,22 @@ public:
         }
         return false;
     }
-    int get_num_tables_serving_word(id token_id) {
-        if (_arrangement.find(token_id) == _arrangement.end()) {
+    int get_num_tables_serving_word(IdT token_id) {
+        auto itr = _arrangement.find(token_id);
+        if (itr == _arrangement.end()) {
             return 0;
         }
-        return _arrangement[token_id].size();
+        return itr->second.num_tables();
     }
-    int get_num_customers_eating_word(id token_id) {
-        if (_arrangement.find(token_id) == _arrangement.end()) {
+    int get_num_customers_eating_word(IdT token_id) {
+        auto itr = _arrangement.find(token_id);
+        if (itr == _arrangement.end()) {
             return 0;
         }
-        vector<int> &num_customers_at_table = _arrangement[token_id];
-        int sum = 0;
-        for (int i=0; i<num_customers_at_table.size(); ++i) {
-            sum += num_customers_at_table[i];
-        }
-        return sum;
+        return itr->second.num_customers();
     }
-    Node *find_child_node(id token_id, bool generate_if_not_exist=false) {
+    BasicNode *find_child_node(IdT token_id, bool generate_if_not_exist=false) {
+        NodeLock lock(this);
         auto itr = _children.find(token_id);
         if (itr != _children.end()) {
             return itr->second;
@@ -119,86 +184,50 @@ public:
         if (generate_if_not_exist == false) {
             return NULL;
         }
-        Node *child = new Node(token_id);
+        BasicNode *child = new BasicNode(token_id);
         child->_parent = this;
         child->_depth = _depth + 1;
         _children[token_id] = child;
         return child;
     }
-    bool add_customer(id token_id, double g0, vector<double> &d_m, vector<double> &theta_m, bool update_beta_count=true) {
-        init_hyperparams_at_depth_if_needed(_depth, d_m, theta_m);
-        double d_u = d_m[_depth];
-        double theta_u = theta_m[_depth];
-        double parent_Pw = g0;
-        if (_parent) {
-            parent_Pw = _parent->compute_Pw(token_id, g0, d_m, theta_m);
-        }
-        auto itr = _arrangement.find(token_id);
-        /* add customer to new table */
-        if (itr == _arrangement.end()) {
-            add_customer_to_new_table(token_id, g0, d_m, theta_m);
-            if (update_beta_count) {
-                increment_stop_count();
-            }
-            return true;
-        }
-        /* add customer to existing table */
-        // num of customer per table
-        vector<int> &num_customers_at_table = itr->second;
-        // for normalizing prob, calculate summation of all prob
-        double sum = 0;
-        for (int k=0; k<num_customers_at_table.size(); ++k) {
-            sum += std::max(0.0, num_customers_at_table[k] - d_u);  // c_k - d_u * t_uw ?
+    // parent_pw_path[n]: Pw of the parent of the depth-n node on the path from root (g0 for root)
+    void compute_parent_Pw_path(IdT token_id, double g0, vector<double> &parent_pw_path, vector<double> &d_m, vector<double> &theta_m) {
+        if (_parent == NULL) {
+            parent_pw_path.resize(_depth + 1);
+            parent_pw_path[_depth] = g0;
+            return;
         }
-        double t_u = _num_tables;
-        sum += (theta_u + d_u * t_u) * parent_Pw;
-        double normalizer = 1.0 / sum;
-        double bernoulli = sampler::uniform(0, 1);
-        double stack = 0;
-        // calculate probabiliry of adding customer to all of table serving `w`
-        for (int k=0; k<num_customers_at_table.size(); ++k) {
-            stack += std::max(0.0, num_customers_at_table[k] - d_u) * normalizer;
-            if (bernoulli <= stack) {
-                add_customer_to_table(token_id, k, g0, d_m, theta_m);
-                if (update_beta_count) {
-                    increment_stop_count();
-                }
-                return true;
+        _parent->compute_parent_Pw_path(token_id, g0, parent_pw_path, d_m, theta_m);
+        parent_pw_path.resize(_depth + 1);
+        NodeLock lock(_parent);
+        parent_pw_path[_depth] = _parent->compute_Pw_with_parent_Pw(token_id, parent_pw_path[_depth - 1], d_m, theta_m);
+    }
+    bool add_customer(IdT token_id, vector<double> &parent_pw_path, vector<double> &d_m, vector<double> &theta_m, bool update_beta_count=true) {
+        init_hyperparams_at_depth_if_needed(_depth, d_m, theta_m);
+        if (seat_customer(token_id, parent_pw_path[_depth], d_m[_depth], theta_m[_depth]) && _parent != NULL) {
+            // send dummy customer to parent node(restraunt)
+            // ancestors are untouched so far, so their entries of `parent_pw_path` are still valid
+            if (defer_root_customer(token_id, 1) == false) {
+                _parent->add_customer(token_id, parent_pw_path, d_m, theta_m, false);
             }
         }
-        add_customer_to_new_table(token_id, g0, d_m, theta_m);
         if (update_beta_count) {
             increment_stop_count();
         }
         return true;
     }
-    bool remove_customer(id token_id, bool update_beta_count=true) {
-        auto itr = _arrangement.find(token_id);
-        // num of customer per table
-        vector<int> &num_customers_at_table = itr->second;
-        // for normalizer 
-        double sum = std::accumulate(num_customers_at_table.begin(), num_customers_at_table.end(), 0);
-        double normalizer = 1.0 / sum;
-        double bernoulli = sampler::uniform(0, 1);
-        double stack = 0;
-        // c_{u w k}; num of customer at table k of restaurant u serving word w
-        for (int k=0; k<num_customers_at_table.size(); ++k) {
-            stack += num_customers_at_table[k] * normalizer;
-            if (bernoulli <= stack) {
-                remove_customer_from_table(token_id, k);
-                if (update_beta_count) {
-                    decrement_stop_count();
-                }
-                return true;
+    bool remove_customer(IdT token_id, bool update_beta_count=true) {
+        if (unseat_customer(token_id) && _parent != NULL) {
+            if (defer_root_customer(token_id, -1) == false) {
+                _parent->remove_customer(token_id, false);
             }
         }
-        remove_customer_from_table(token_id, num_customers_at_table.size() - 1);
         if (update_beta_count) {
             decrement_stop_count();
         }
         return true;
     }
-    double compute_Pw(id token_id, double g0, vector<double> &d_m, vector<double> &theta_m) {
+    double compute_Pw(IdT token_id, double g0, vector<double> &d_m, vector<double> &theta_m) {
         init_hyperparams_at_depth_if_needed(_depth, d_m, theta_m);
         double d_u = d_m[_depth];
         double theta_u = theta_m[_depth];
@@ -220,17 +249,17 @@ public:
             // calculate recursively if parent does exist!
             parent_Pw = _parent->compute_Pw(token_id, g0, d_m, theta_m);
         }
-        vector<int> &num_customers_at_table = itr->second;
+        table_record &tables = itr->second;
         // c_uw: aggregate num of customer at all table of restaurant u serving word w
-        double c_uw = std::accumulate(num_customers_at_table.begin(), num_customers_at_table.end(), 0);
+        double c_uw = tables.num_customers();
         // t_uw: aggregate num of table at restaurant u serving word w
-        double t_uw = num_customers_at_table.size();
+        double t_uw = tables.num_tables();
         double first_term = std::max(0.0, c_uw - d_u * t_uw) / (theta_u + c_u);
         double second_coeff = (theta_u + d_u * t_u) / (theta_u + c_u);
         return first_term + second_coeff * parent_Pw;
     }
     // avoiding recursive calculation of parent Pw with serving parent Pw in advance
-    double compute_Pw_with_parent_Pw(id token_id, double parent_pw, vector<double> &d_m, vector<double> &theta_m) {
+    double compute_Pw_with_parent_Pw(IdT token_id, double parent_pw, vector<double> &d_m, vector<double> &theta_m) {
         init_hyperparams_at_depth_if_needed(_depth, d_m, theta_m);
         double d_u = d_m[_depth];
         double theta_u = theta_m[_depth];
@@ -242,11 +271,11 @@ public:
             double coeff = (theta_u + d_u * t_u) / (theta_u + c_u);
             return parent_pw * coeff;
         }
-        vector<int> &num_customers_at_table = itr->second;
+        table_record &tables = itr->second;
         // c_uw: aggregate num of customer at all table of restaurant u serving word w
-        double c_uw = std::accumulate(num_customers_at_table.begin(), num_customers_at_table.end(), 0);
+        double c_uw = tables.num_customers();
         // t_uw: aggregate num of table at restaurant u serving word w
-        double t_uw = num_customers_at_table.size();
+        double t_uw = tables.num_tables();
         double first_term = std::max(0.0, c_uw - d_u * t_uw) / (theta_u + c_u);
         double second_coeff = (theta_u + d_u * t_u) / (theta_u + c_u);
         return first_term + second_coeff * parent_pw;
@@ -273,25 +302,43 @@ public:
         return p;
     }
     void increment_stop_count() {
-        _stop_count++;
+        {
+            NodeLock lock(this);
+            _stop_count++;
+        }
         if (_parent != NULL) {
             _parent->increment_pass_count();
         }
     }
     void decrement_stop_count() {
-        _stop_count--;
+        {
+            NodeLock lock(this);
+            _stop_count--;
+        }
         if (_parent != NULL) {
             _parent->decrement_pass_count();
         }
     }
     void increment_pass_count() {
-        _pass_count++;
+        if (defer_root_pass_count(1)) {
+            return;
+        }
+        if (buffer_pass_count(1) == false) {
+            NodeLock lock(this);
+            _pass_count++;
+        }
         if (_parent != NULL) {
             _parent->increment_pass_count();
         }
     }
     void decrement_pass_count() {
-        _pass_count--;
+        if (defer_root_pass_count(-1)) {
+            return;
+        }
+        if (buffer_pass_count(-1) == false) {
+            NodeLock lock(this);
+            _pass_count--;
+        }
         if (_parent != NULL) {
             _parent->decrement_pass_count();
         }
@@ -303,8 +350,8 @@ public:
         _parent->delete_child_node(_token_id);
         return true;
     }
-    void delete_child_node(id token_id) {
-        Node *child = find_child_node(token_id);
+    void delete_child_node(IdT token_id) {
+        BasicNode *child = find_child_node(token_id);
         if (child) {
             _children.erase(token_id);
             delete child;
@@ -333,17 +380,25 @@ public:
     int get_num_tables() {
         int num = 0;
         for (auto &elem : _arrangement) {
-            num += elem.second.size();
+            num += elem.second.num_tables();
         }
         for (auto &elem : _children) {
             num += elem.second->get_num_tables();
         }
         return num;
     }
+    // entries of the arrangements of this node and its descendants
+    int get_num_words() {
+        int num = _arrangement.size();
+        for (auto &elem : _children) {
+            num += elem.second->get_num_words();
+        }
+        return num;
+    }
     int get_num_customers() {
         int num = 0;
         for (auto &elem : _arrangement) {
-            num += std::accumulate(elem.second.begin(), elem.second.end(), 0);
+            num += elem.second.num_customers();
         }
         for (auto &elem : _children) {
             num += elem.second->get_num_customers();
@@ -372,7 +427,7 @@ public:
             elem.second->count_tokens_of_each_depth(counts);
         }
     }
-    void enumerate_nodes_at_depth(int depth, vector<Node*> &nodes){
+    void enumerate_nodes_at_depth(int depth, vector<BasicNode*> &nodes){
         if(_depth == depth){
             nodes.push_back(this);
         }
@@ -380,6 +435,14 @@ public:
             elem.second->enumerate_nodes_at_depth(depth, nodes);
         }
     }
+    void enumerate_leaves(vector<BasicNode*> &nodes) {
+        if (_children.size() == 0) {
+            nodes.push_back(this);
+        }
+        for (auto &elem : _children) {
+            elem.second->enumerate_leaves(nodes);
+        }
+    }
     // for estimating `d` and `theta`; supplementary variable
     // x_u, y_ui, z_uwkj
     double auxiliary_log_x_u(double theta_u) {
@@ -389,47 +452,54 @@ public:
         }
         return 0;
     }
-    double auxiliary_y_ui(double d_u, double theta_u) {
+    // y_ui for i = 1, ..., t_u - 1; both sums come from the same draws
+    void auxiliary_y_ui(double d_u, double theta_u, double &sum_y_ui, double &sum_1_y_ui) {
+        sum_y_ui = 0;
+        sum_1_y_ui = 0;
         if(_num_tables >= 2) {
-            double sum_y_ui = 0;
             for(int i=1; i<=_num_tables-1; ++i) {
                 double denominator = theta_u + d_u * i;
                 assert(denominator > 0);
                 sum_y_ui += sampler::bernoulli(theta_u / denominator);
             }
-            return sum_y_ui;
+            sum_1_y_ui = _num_tables - 1 - sum_y_ui;
         }
-        return 0;
-    }
-    double auxiliary_1_y_ui(double d_u, double theta_u) {
-        if(_num_tables >= 2) {
-            double sum_1_y_ui = 0;
-            for(int i=1; i<=_num_tables-1; ++i) {
-                double denominator = theta_u + d_u * i;
-                assert(denominator > 0);
-                sum_1_y_ui += 1.0 - sampler::bernoulli(theta_u / denominator);
-            }
-            return sum_1_y_ui;
-        }
-        return 0;
     }
+    // z_uwkj ~ Bernoulli((j - 1) / (j - d_u)) for j = 1, ..., c_uwk - 1 at every table of the restaurant,
+    // so sum_uwk (1 - z_uwkj) for a given j is Binomial(N_j, (1 - d_u) / (j - d_u)), N_j = num of tables with c_uwk > j
+    // one draw per j instead of one per customer; j = 1 always gives N_1
     double auxiliary_1_z_uwkj(double d_u) {
-        double sum_z_uwkj = 0;
-        // c_u..
-        for(auto elem : _arrangement) {
-            // c_uw.
-            vector<int> &num_customers_at_table = elem.second;
-            for(int k=0; k<num_customers_at_table.size(); ++k) {
-                // c_uwk
-                int c_uwk = num_customers_at_table[k];
+        // num_tables_by_size[c]: num of tables with c customers
+        static thread_local vector<int> num_tables_by_size;
+        num_tables_by_size.clear();
+        for(auto &elem : _arrangement) {
+            table_record &tables = elem.second;
+            for(int k=0; k<tables.num_bins(); ++k) {
+                int c_uwk = tables.bin_size(k);
                 if(c_uwk >= 2){
-                    for(int j=1; j<=c_uwk-1; ++j) {
-                        assert(j - d_u > 0);
-                        sum_z_uwkj += 1 - sampler::bernoulli((j - 1) / (j - d_u));
+                    if(c_uwk >= num_tables_by_size.size()) {
+                        num_tables_by_size.resize(c_uwk + 1, 0);
                     }
+                    num_tables_by_size[c_uwk] += tables.bin_tables(k);
                 }
             }
         }
+        double sum_z_uwkj = 0;
+        int num_tables_larger = 0;     // N_j
+        for(int j=(int)num_tables_by_size.size()-1; j>=1; --j) {
+            if(j + 1 < num_tables_by_size.size()) {
+                num_tables_larger += num_tables_by_size[j + 1];
+            }
+            if(num_tables_larger == 0) {
+                continue;
+            }
+            assert(j - d_u > 0);
+            if(j == 1) {
+                sum_z_uwkj += num_tables_larger;
+            } else {
+                sum_z_uwkj += sampler::binomial(num_tables_larger, (1 - d_u) / (j - d_u));
+            }
+        }
         return sum_z_uwkj;
     }
     void init_hyperparams_at_depth_if_needed(int depth, vector<double> &d_m, vector<double> &theta_m) {
@@ -442,9 +512,85 @@ public:
             }
         }
     }
+    // what the nodes of a thread would write to the root, applied later by `BasicVPYLM::apply_root_updates`
+    // threads seating customers into disjoint subtrees of the root then write to none of the nodes of the others and
+    // only read the root; NULL unless set by the thread
+    struct RootUpdates {
+        vector<pair<IdT, int>> customers;       // proxy customers of each token id, 1 to seat and -1 to unseat, in order
+        int pass_count;
+
+        RootUpdates() {
+            pass_count = 0;
+        }
+        void clear() {
+            customers.clear();
+            pass_count = 0;
+        }
+    };
+    static RootUpdates *&deferred_root_updates() {
+        static thread_local RootUpdates *updates = NULL;
+        return updates;
+    }
+    // pass counts a thread sharing the tree adds to nodes shallower than VPYLM_HOGWILD_BUFFERED_DEPTH later on
+    // NULL unless set by the thread; see `BasicVPYLM::flush_buffered_pass_counts`
+    static pointer_hashmap<BasicNode, int> *&buffered_pass_counts() {
+        static thread_local pointer_hashmap<BasicNode, int> *counts = NULL;
+        return counts;
+    }
+    // token ids of the file being loaded mapped to ids of the current vocabulary, if they differ
+    static unordered_map<uint64_t, id> *&loaded_token_ids() {
+        static thread_local unordered_map<uint64_t, id> *token_ids = NULL;
+        return token_ids;
+    }
+    static IdT loaded_token_id(uint64_t token_id) {
+        id mapped_token_id = loaded_token_ids()->at(token_id);
+        if (mapped_token_id > std::numeric_limits<IdT>::max()) {
+            throw std::runtime_error("a token id of the model file does not fit in the token id type");
+        }
+        return mapped_token_id;
+    }
+    template<typename KeyT, typename ValueT, int N>
+    void remap_token_ids(SmallMap<KeyT, ValueT, N> &src, SmallMap<IdT, ValueT, N> &dst) {
+        vector<pair<IdT, ValueT>> entries;
+        for (auto &elem : src) {
+            entries.push_back(std::make_pair(loaded_token_id(elem.first), std::move(elem.second)));
+        }
+        src.clear();
+        dst.clear();
+        for (auto &entry : entries) {
+            dst[entry.first] = std::move(entry.second);
+        }
+    }
+    // files written before dense ids keyed everything by 64-bit hashes of the words
+    template <class Archive>
+    void load_hashed_token_ids(Archive& archive)
+    {
+        if (loaded_token_ids() == NULL || loaded_token_ids()->empty()) {
+            throw std::runtime_error("the model file predates dense token ids and needs the vocabulary saved with it");
+        }
+        SmallMap<uint64_t, BasicNode*, VPYLM_INLINE_CHILDREN> children;
+        SmallMap<uint64_t, table_record, VPYLM_INLINE_WORDS> arrangement;
+        uint64_t token_id;
+        archive & children;
+        archive & arrangement;
+        archive & _num_tables;
+        archive & _num_customers;
+        archive & _parent;
+        archive & _stop_count;
+        archive & _pass_count;
+        archive & token_id;
+        archive & _depth;
+        remap_token_ids(children, _children);
+        remap_token_ids(arrangement, _arrangement);
+        _token_id = loaded_token_id(token_id);
+    }
     template <class Archive>
     void serialize(Archive& archive, unsigned int version)
     {
+        if (version == 0) {
+            load_hashed_token_ids(archive);
+            return;
+        }
         archive & _children;
         archive & _arrangement;
         archive & _num_tables;
@@ -454,8 +600,13 @@ public:
         archive & _pass_count;
         archive & _token_id;
         archive & _depth;
+        if (Archive::is_loading::value && loaded_token_ids() != NULL && loaded_token_ids()->empty() == false) {
+            remap_token_ids(_children, _children);
+            remap_token_ids(_arrangement, _arrangement);
+            _token_id = loaded_token_id(_token_id);
+        }
     }
-    friend ostream& operator<<(ostream& os, const Node& node){
+    friend ostream& operator<<(ostream& os, const BasicNode& node){
         os << "[id." << node._token_id << ":depth." << node._depth << "]" << endl;
         os << "_num_tables: " << node._num_tables << ", _num_customers: " << node._num_customers << endl;
         os << "_stop_count: " << node._stop_count << ", _pass_count: " << node._pass_count << endl;
@@ -463,8 +614,11 @@ public:
         for(auto elem: node._arrangement){
             os << "  [" << elem.first << "]" << endl;
             os << "    ";
-            for(auto customers: elem.second){
-                os << customers << ",";
+            const table_record &tables = elem.second;
+            for(int k=0; k<tables.num_bins(); ++k){
+                for(int m=0; m<tables.bin_tables(k); ++m){
+                    os << tables.bin_size(k) << ",";
+                }
             }
             os << endl;
         }
@@ -476,4 +630,14 @@ public:
         os << endl;
         return os;
     }
-};
\ No newline at end of file
+};
+namespace boost { namespace serialization {
+template<typename IdT, typename CountT>
+struct version<BasicNode<IdT, CountT>> {
+    typedef mpl::int_<1> type;
+    typedef mpl::integral_c_tag tag;
+    BOOST_STATIC_CONSTANT(int, value = version::type::value);
+};
+}}
+
+using Node = BasicNode<id, table_count>;
@@ -0,0 +1,128 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <thread>
+using namespace std;
+
+#define NODE_LOCK_NUM_STRIPES 4096      // must be a power of 2
+#define NODE_LOCK_SPINS_BEFORE_YIELD 64
+
+// counters of a thread seating customers into a tree shared with other threads
+struct ContentionStats {
+    long num_locks;                 // node locks taken
+    long num_contended_locks;       // locks that were held by another thread
+    long num_spins;                 // failed attempts while waiting for them
+    long num_missing_customers;     // customers already taken away by a racing thread
+    long num_buffered_counts;       // pass counts kept back by the thread
+    long num_flushes;               // batches in which they were applied to the tree
+
+    ContentionStats() {
+        clear();
+    }
+    void clear() {
+        num_locks = 0;
+        num_contended_locks = 0;
+        num_spins = 0;
+        num_missing_customers = 0;
+        num_buffered_counts = 0;
+        num_flushes = 0;
+    }
+    void add(const ContentionStats &other) {
+        num_locks += other.num_locks;
+        num_contended_locks += other.num_contended_locks;
+        num_spins += other.num_spins;
+        num_missing_customers += other.num_missing_customers;
+        num_buffered_counts += other.num_buffered_counts;
+        num_flushes += other.num_flushes;
+    }
+};
+
+// spinlocks of the nodes of a shared tree, striped by node address so that nodes need no extra memory
+// a thread holds at most one of them at a time, so two nodes sharing a stripe never deadlock
+class NodeLockTable {
+private:
+    struct Stripe {
+        std::atomic_flag flag;
+        char padding[64 - sizeof(std::atomic_flag)];    // one stripe per cache line
+    };
+    Stripe _stripes[NODE_LOCK_NUM_STRIPES];
+
+    static size_t stripe_index(const void *node) {
+        return ((uintptr_t)node >> 4) * 0x9E3779B97F4A7C15ULL >> 32 & (NODE_LOCK_NUM_STRIPES - 1);
+    }
+public:
+    NodeLockTable() {
+        for (int k=0; k<NODE_LOCK_NUM_STRIPES; ++k) {
+            _stripes[k].flag.clear();
+        }
+    }
+    NodeLockTable(const NodeLockTable &) = delete;
+    NodeLockTable &operator=(const NodeLockTable &) = delete;
+    void lock(const void *node, ContentionStats *stats) {
+        std::atomic_flag &flag = _stripes[stripe_index(node)].flag;
+        stats->num_locks++;
+        if (flag.test_and_set(std::memory_order_acquire) == false) {
+            return;
+        }
+        stats->num_contended_locks++;
+        int spins = 0;
+        do {
+            // the holder may be preempted when there are more threads than cores
+            if (++spins % NODE_LOCK_SPINS_BEFORE_YIELD == 0) {
+                std::this_thread::yield();
+            }
+        } while (flag.test_and_set(std::memory_order_acquire));
+        stats->num_spins += spins;
+    }
+    void unlock(const void *node) {
+        _stripes[stripe_index(node)].flag.clear(std::memory_order_release);
+    }
+    // table of the current thread; NULL unless a `Scope` is alive, and nodes are not locked then
+    static NodeLockTable *&current() {
+        static thread_local NodeLockTable *table = NULL;
+        return table;
+    }
+    static ContentionStats *&current_stats() {
+        static thread_local ContentionStats *stats = NULL;
+        return stats;
+    }
+    // locks nodes of this thread with `table` and counts into `stats` while alive
+    class Scope {
+    private:
+        NodeLockTable *_prev;
+        ContentionStats *_prev_stats;
+    public:
+        Scope(NodeLockTable *table, ContentionStats *stats) {
+            _prev = current();
+            _prev_stats = current_stats();
+            current() = table;
+            current_stats() = stats;
+        }
+        ~Scope() {
+            current() = _prev;
+            current_stats() = _prev_stats;
+        }
+    };
+};
+
+// holds the lock of `node` for the scope if the thread shares its tree
+class NodeLock {
+private:
+    NodeLockTable *_table;
+    const void *_node;
+public:
+    NodeLock(const void *node) {
+        _table = NodeLockTable::current();
+        _node = node;
+        if (_table) {
+            _table->lock(node, NodeLockTable::current_stats());
+        }
+    }
+    NodeLock(const NodeLock &) = delete;
+    NodeLock &operator=(const NodeLock &) = delete;
+    ~NodeLock() {
+        if (_table) {
+            _table->unlock(_node);
+        }
+    }
+};
@@ -0,0 +1,511 @@
+#pragma once
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "common.hpp"
+#include "flat_vpylm.hpp"
+#include "scoring_state.hpp"
+using namespace std;
+
+#define QUANTIZED_VPYLM_MAGIC "VPYLMQNT"
+#define QUANTIZED_VPYLM_VERSION 1
+#define QUANTIZED_VPYLM_LLOYD_ITERATIONS 16
+
+// VPYLM for scoring that keeps only what `compute_Pw_given_h` reads: the stop probability and the backoff coefficient
+// (theta_u + d_u * t_u) / (theta_u + c_u) of every node, and the first term (c_uw - d_u * t_uw) / (theta_u + c_u) of
+// every word, each stored as an 8 or 16-bit code into a codebook of its own
+// the tree has the layout of `BasicFlatVPYLM`, with codes in place of counts
+template<typename IdT>
+class BasicQuantizedVPYLM {
+public:
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t id_bytes;
+        uint32_t code_bytes;
+        uint32_t padding;
+        uint64_t num_nodes;
+        uint64_t num_words;
+        uint64_t num_root_words;
+        uint64_t num_stop_codes;        // entries of each codebook
+        uint64_t num_coeff_codes;
+        uint64_t num_first_term_codes;
+        double g0;
+        // byte offsets of the arrays from the start of the file
+        uint64_t stop_codebook_offset;
+        uint64_t coeff_codebook_offset;
+        uint64_t first_term_codebook_offset;
+        uint64_t node_token_ids_offset;
+        uint64_t nodes_offset;
+        uint64_t stop_codes_offset;
+        uint64_t coeff_codes_offset;
+        uint64_t word_token_ids_offset;
+        uint64_t first_term_codes_offset;
+        uint64_t root_first_term_codes_offset;
+        uint64_t file_size;
+    };
+    struct Node {
+        uint32_t children_begin;    // index of the first child in the node arrays
+        uint32_t num_children;
+        uint32_t words_begin;       // index of the first word in the word arrays
+        uint32_t num_words;
+    };
+private:
+    using Flat = BasicFlatVPYLM<IdT>;
+
+    void *_data;
+    size_t _size;
+    bool _mapped;                   // `_data` is a mapping of a file rather than `_buffer`
+    vector<uint64_t> _buffer;       // of a quantized tree
+    const Header *_header;
+    const double *_stop_codebook;
+    const double *_coeff_codebook;
+    const double *_first_term_codebook;     // entry 0 is 0, the first term of words a node does not serve
+    const IdT *_node_token_ids;
+    const Node *_nodes;
+    const void *_stop_codes;        // indexed like `_nodes`
+    const void *_coeff_codes;
+    const IdT *_word_token_ids;
+    const void *_first_term_codes;  // indexed like `_word_token_ids`
+    const void *_root_first_term_codes;     // of the root again, indexed by token id
+
+    // codebook of at most `size` sorted values close to `values` in squared error, by Lloyd's algorithm from
+    // quantiles; exact when there are no more distinct values than `size`
+    static void build_codebook(vector<double> values, int size, vector<double> &codebook) {
+        std::sort(values.begin(), values.end());
+        vector<double> distinct;
+        vector<double> weights;
+        for (double value : values) {
+            if (distinct.empty() || distinct.back() != value) {
+                distinct.push_back(value);
+                weights.push_back(0);
+            }
+            weights.back() += 1;
+        }
+        if (distinct.size() <= size) {
+            codebook = distinct;
+            return;
+        }
+        // group k covers distinct values [begins[k], begins[k + 1]); first groups of equal weight
+        vector<int> begins(size + 1, distinct.size());
+        int k = 0;
+        double cumulative_weight = 0;
+        for (int i=0; i<distinct.size() && k<size; ++i) {
+            // every group keeps at least one value
+            if (cumulative_weight >= values.size() * (double)k / size || distinct.size() - i <= size - k) {
+                begins[k++] = i;
+            }
+            cumulative_weight += weights[i];
+        }
+        codebook.resize(size);
+        for (int iteration=0; iteration<=QUANTIZED_VPYLM_LLOYD_ITERATIONS; ++iteration) {
+            for (int k=0; k<size; ++k) {
+                double sum = 0;
+                double sum_weights = 0;
+                for (int i=begins[k]; i<begins[k + 1]; ++i) {
+                    sum += distinct[i] * weights[i];
+                    sum_weights += weights[i];
+                }
+                if (sum_weights > 0) {
+                    codebook[k] = sum / sum_weights;
+                } else if (k > 0) {
+                    codebook[k] = codebook[k - 1];
+                }
+            }
+            if (iteration == QUANTIZED_VPYLM_LLOYD_ITERATIONS) {
+                break;
+            }
+            // each value goes to the nearest entry, so groups stay contiguous
+            int i = 0;
+            for (int k=0; k<size; ++k) {
+                begins[k] = i;
+                double boundary = k + 1 < size ? (codebook[k] + codebook[k + 1]) / 2 : std::numeric_limits<double>::infinity();
+                while (i < distinct.size() && distinct[i] < boundary) {
+                    i++;
+                }
+            }
+        }
+    }
+    // index of the entry of `codebook` nearest to `value`
+    static uint32_t encode(const vector<double> &codebook, double value) {
+        auto itr = std::lower_bound(codebook.begin(), codebook.end(), value);
+        if (itr == codebook.end()) {
+            return codebook.size() - 1;
+        }
+        if (itr != codebook.begin() && value - *(itr - 1) < *itr - value) {
+            --itr;
+        }
+        return itr - codebook.begin();
+    }
+    static double logit(double p) {
+        return log(p / (1.0 - p));
+    }
+    template<typename CodeT>
+    static void append_codes(vector<char> &bytes, const vector<uint32_t> &codes, uint64_t &offset) {
+        Flat::append_array(bytes, vector<CodeT>(codes.begin(), codes.end()), offset);
+    }
+    uint32_t code_at(const void *codes, uint64_t index) const {
+        if (_header->code_bytes == 1) {
+            return ((const uint8_t*)codes)[index];
+        }
+        return ((const uint16_t*)codes)[index];
+    }
+    template<typename T>
+    const T *array_at(uint64_t offset, uint64_t count, uint64_t element_bytes=sizeof(T)) {
+        if (offset % 8 != 0 || offset > _size || count > (_size - offset) / element_bytes) {
+            throw std::runtime_error("the quantized model file is truncated or corrupt");
+        }
+        return (const T*)((const char*)_data + offset);
+    }
+    // points the arrays into `_data`; throws unless it holds a quantized model with ids of this width and valid codes
+    void attach() {
+        _header = (const Header*)_data;
+        if (std::memcmp(_header->magic, QUANTIZED_VPYLM_MAGIC, sizeof(_header->magic)) != 0 || _header->version != QUANTIZED_VPYLM_VERSION) {
+            throw std::runtime_error("not a quantized model of version " + std::to_string(QUANTIZED_VPYLM_VERSION));
+        }
+        if (_header->id_bytes != sizeof(IdT)) {
+            throw std::runtime_error("the quantized model was saved with " + std::to_string(_header->id_bytes) + "-byte token ids");
+        }
+        uint64_t code_bytes = _header->code_bytes;
+        if (_header->file_size != _size || _header->num_nodes == 0 || (code_bytes != 1 && code_bytes != 2)) {
+            throw std::runtime_error("the quantized model file is truncated or corrupt");
+        }
+        _stop_codebook = array_at<double>(_header->stop_codebook_offset, _header->num_stop_codes);
+        _coeff_codebook = array_at<double>(_header->coeff_codebook_offset, _header->num_coeff_codes);
+        _first_term_codebook = array_at<double>(_header->first_term_codebook_offset, _header->num_first_term_codes);
+        _node_token_ids = array_at<IdT>(_header->node_token_ids_offset, _header->num_nodes);
+        _nodes = array_at<Node>(_header->nodes_offset, _header->num_nodes);
+        _stop_codes = array_at<void>(_header->stop_codes_offset, _header->num_nodes, code_bytes);
+        _coeff_codes = array_at<void>(_header->coeff_codes_offset, _header->num_nodes, code_bytes);
+        _word_token_ids = array_at<IdT>(_header->word_token_ids_offset, _header->num_words);
+        _first_term_codes = array_at<void>(_header->first_term_codes_offset, _header->num_words, code_bytes);
+        _root_first_term_codes = array_at<void>(_header->root_first_term_codes_offset, _header->num_root_words, code_bytes);
+        // codes index their codebooks and node ranges index the arrays without checks when scoring; the ranges must
+        // tile the arrays in the breadth-first order of the flat model
+        uint64_t num_nodes = 1;
+        uint64_t num_words = 0;
+        for (uint64_t index=0; index<_header->num_nodes; ++index) {
+            if (code_at(_stop_codes, index) >= _header->num_stop_codes || code_at(_coeff_codes, index) >= _header->num_coeff_codes) {
+                throw std::runtime_error("the quantized model file is truncated or corrupt");
+            }
+            const Node &node = _nodes[index];
+            if (node.children_begin != num_nodes || node.num_children > _header->num_nodes - num_nodes
+                || node.words_begin != num_words || node.num_words > _header->num_words - num_words) {
+                throw std::runtime_error("the quantized model file is truncated or corrupt");
+            }
+            num_nodes += node.num_children;
+            num_words += node.num_words;
+        }
+        if (num_nodes != _header->num_nodes || num_words != _header->num_words) {
+            throw std::runtime_error("the quantized model file is truncated or corrupt");
+        }
+        for (uint64_t index=0; index<_header->num_words; ++index) {
+            if (code_at(_first_term_codes, index) >= _header->num_first_term_codes) {
+                throw std::runtime_error("the quantized model file is truncated or corrupt");
+            }
+        }
+        for (uint64_t index=0; index<_header->num_root_words; ++index) {
+            if (code_at(_root_first_term_codes, index) >= _header->num_first_term_codes) {
+                throw std::runtime_error("the quantized model file is truncated or corrupt");
+            }
+        }
+    }
+    double first_term(long index, IdT token_id) const {
+        if (index == 0) {
+            if (token_id >= _header->num_root_words) {
+                return 0;
+            }
+            return _first_term_codebook[code_at(_root_first_term_codes, token_id)];
+        }
+        const Node &node = _nodes[index];
+        long k = Flat::search(_word_token_ids + node.words_begin, node.num_words, token_id);
+        if (k < 0) {
+            return 0;
+        }
+        return _first_term_codebook[code_at(_first_term_codes, node.words_begin + k)];
+    }
+public:
+    BasicQuantizedVPYLM() {
+        _data = NULL;
+        _size = 0;
+        _mapped = false;
+    }
+    BasicQuantizedVPYLM(const BasicQuantizedVPYLM &) = delete;
+    BasicQuantizedVPYLM &operator=(const BasicQuantizedVPYLM &) = delete;
+    ~BasicQuantizedVPYLM() {
+        unload();
+    }
+    // converts `model` into this structure with codes of `num_bits` (8 or 16)
+    // first terms and backoff coefficients are quantized in the log domain, stop probabilities in the logit domain
+    template<typename CountT>
+    void quantize(BasicVPYLM<IdT, CountT> &model, int num_bits) {
+        if (num_bits != 8 && num_bits != 16) {
+            throw std::runtime_error("codes must be of 8 or 16 bits");
+        }
+        unload();
+        Flat flat;
+        flat.freeze(model);
+        const typename Flat::Header &flat_header = *flat._header;
+        // the tree is laid out as that of `flat`, and its depths follow from the BFS order
+        vector<int> depths(flat_header.num_nodes, 0);
+        vector<double> stops(flat_header.num_nodes);
+        vector<double> coeffs(flat_header.num_nodes);
+        vector<double> first_terms(flat_header.num_words);
+        vector<Node> nodes(flat_header.num_nodes);
+        for (uint64_t index=0; index<flat_header.num_nodes; ++index) {
+            const typename Flat::Node &node = flat._nodes[index];
+            for (uint32_t k=0; k<node.num_children; ++k) {
+                depths[node.children_begin + k] = depths[index] + 1;
+            }
+            double d_u = flat._d_m[depths[index]];
+            double theta_u = flat._theta_m[depths[index]];
+            double c_u = node.num_customers;
+            stops[index] = (node.stop_count + flat_header.beta_stop) / (node.stop_count + node.pass_count + flat_header.beta_stop + flat_header.beta_pass);
+            coeffs[index] = (theta_u + d_u * node.num_tables) / (theta_u + c_u);
+            for (uint32_t k=0; k<node.num_words; ++k) {
+                const typename Flat::Word &word = flat._words[node.words_begin + k];
+                first_terms[node.words_begin + k] = std::max(0.0, word.num_customers - d_u * word.num_tables) / (theta_u + c_u);
+            }
+            nodes[index] = Node{node.children_begin, node.num_children, node.words_begin, node.num_words};
+        }
+        int num_codes = 1 << num_bits;
+        vector<double> transformed;
+        vector<double> stop_codebook;
+        for (double stop : stops) {
+            transformed.push_back(logit(stop));
+        }
+        build_codebook(transformed, num_codes, stop_codebook);
+        vector<uint32_t> stop_codes;
+        for (double value : transformed) {
+            stop_codes.push_back(encode(stop_codebook, value));
+        }
+        transformed.clear();
+        vector<double> coeff_codebook;
+        for (double coeff : coeffs) {
+            transformed.push_back(log(coeff));
+        }
+        build_codebook(transformed, num_codes, coeff_codebook);
+        vector<uint32_t> coeff_codes;
+        for (double value : transformed) {
+            coeff_codes.push_back(encode(coeff_codebook, value));
+        }
+        // code 0 stands for a first term of 0
+        transformed.clear();
+        for (double first_term : first_terms) {
+            if (first_term > 0) {
+                transformed.push_back(log(first_term));
+            }
+        }
+        vector<double> first_term_codebook;
+        build_codebook(transformed, num_codes - 1, first_term_codebook);
+        vector<uint32_t> first_term_codes;
+        for (double first_term : first_terms) {
+            first_term_codes.push_back(first_term > 0 ? encode(first_term_codebook, log(first_term)) + 1 : 0);
+        }
+        vector<uint32_t> root_first_term_codes(flat_header.num_root_words, 0);
+        for (uint32_t k=0; k<nodes[0].num_words; ++k) {
+            root_first_term_codes[flat._word_token_ids[k]] = first_term_codes[k];
+        }
+        // codebooks are stored decoded
+        for (double &value : stop_codebook) {
+            value = 1.0 / (1.0 + exp(-value));
+        }
+        for (double &value : coeff_codebook) {
+            value = exp(value);
+        }
+        for (double &value : first_term_codebook) {
+            value = exp(value);
+        }
+        first_term_codebook.insert(first_term_codebook.begin(), 0);
+        Header header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, QUANTIZED_VPYLM_MAGIC, sizeof(header.magic));
+        header.version = QUANTIZED_VPYLM_VERSION;
+        header.id_bytes = sizeof(IdT);
+        header.code_bytes = num_bits / 8;
+        header.num_nodes = flat_header.num_nodes;
+        header.num_words = flat_header.num_words;
+        header.num_root_words = flat_header.num_root_words;
+        header.num_stop_codes = stop_codebook.size();
+        header.num_coeff_codes = coeff_codebook.size();
+        header.num_first_term_codes = first_term_codebook.size();
+        header.g0 = flat_header.g0;
+        vector<char> bytes(sizeof(header));
+        Flat::append_array(bytes, stop_codebook, header.stop_codebook_offset);
+        Flat::append_array(bytes, coeff_codebook, header.coeff_codebook_offset);
+        Flat::append_array(bytes, first_term_codebook, header.first_term_codebook_offset);
+        Flat::append_array(bytes, vector<IdT>(flat._node_token_ids, flat._node_token_ids + flat_header.num_nodes), header.node_token_ids_offset);
+        Flat::append_array(bytes, nodes, header.nodes_offset);
+        Flat::append_array(bytes, vector<IdT>(flat._word_token_ids, flat._word_token_ids + flat_header.num_words), header.word_token_ids_offset);
+        if (num_bits == 8) {
+            append_codes<uint8_t>(bytes, stop_codes, header.stop_codes_offset);
+            append_codes<uint8_t>(bytes, coeff_codes, header.coeff_codes_offset);
+            append_codes<uint8_t>(bytes, first_term_codes, header.first_term_codes_offset);
+            append_codes<uint8_t>(bytes, root_first_term_codes, header.root_first_term_codes_offset);
+        } else {
+            append_codes<uint16_t>(bytes, stop_codes, header.stop_codes_offset);
+            append_codes<uint16_t>(bytes, coeff_codes, header.coeff_codes_offset);
+            append_codes<uint16_t>(bytes, first_term_codes, header.first_term_codes_offset);
+            append_codes<uint16_t>(bytes, root_first_term_codes, header.root_first_term_codes_offset);
+        }
+        bytes.resize((bytes.size() + 7) / 8 * 8, 0);
+        header.file_size = bytes.size();
+        std::memcpy(bytes.data(), &header, sizeof(header));
+        _buffer.resize(bytes.size() / 8);
+        std::memcpy(_buffer.data(), bytes.data(), bytes.size());
+        _data = _buffer.data();
+        _size = bytes.size();
+        attach();
+    }
+    // writes the structure to a file that `load` maps as is
+    bool save(string filename) const {
+        std::ofstream ofs(filename, std::ios::binary);
+        if (ofs.good() == false) {
+            return false;
+        }
+        ofs.write((const char*)_data, _size);
+        return ofs.good();
+    }
+    template<typename CountT>
+    static bool save(BasicVPYLM<IdT, CountT> &model, int num_bits, string filename) {
+        BasicQuantizedVPYLM quantized;
+        quantized.quantize(model, num_bits);
+        return quantized.save(filename);
+    }
+    // maps the file; false if it cannot be opened, and throws if it is not a quantized model with ids of this width
+    bool load(string filename) {
+        unload();
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(Header)) {
+            ::close(fd);
+            throw std::runtime_error(filename + " is not a quantized model file");
+        }
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            throw std::runtime_error("failed to map " + filename);
+        }
+        _data = data;
+        _size = st.st_size;
+        _mapped = true;
+        try {
+            attach();
+        } catch (...) {
+            unload();
+            throw;
+        }
+        return true;
+    }
+    void unload() {
+        if (_mapped) {
+            munmap(_data, _size);
+        }
+        _buffer.clear();
+        _buffer.shrink_to_fit();
+        _data = NULL;
+        _size = 0;
+        _mapped = false;
+    }
+    bool is_loaded() const {
+        return _data != NULL;
+    }
+    // same walk as `BasicVPYLM::compute_Pw_given_h` with Pw_u = first_u(w) + coeff_u * Pw_{parent}
+    double compute_Pw_given_h(IdT token_id, const vector<IdT> &context_token_ids) const {
+        return compute_Pw_given_context(token_id, BasicContextView<IdT>(context_token_ids));
+    }
+    // `context` is read by `size()` and `recent(n)`, see `BasicScoringState`
+    template<typename ContextT>
+    double compute_Pw_given_context(IdT token_id, const ContextT &context) const {
+        long index = 0;
+        // censoring if stop prob below this value
+        double eps = 1e-24;
+        double parent_pw = _header->g0;
+        double p_pass = 1;
+        double pw_h = 0;
+        int depth = 0;
+        while (index >= 0) {
+            const Node &node = _nodes[index];
+            double pw = first_term(index, token_id) + _coeff_codebook[code_at(_coeff_codes, index)] * parent_pw;
+            double stop = _stop_codebook[code_at(_stop_codes, index)];
+            double p_stop = stop * p_pass;
+            p_pass *= 1.0 - stop;
+            pw_h += pw * p_stop;
+            parent_pw = pw;
+            if (p_stop <= eps) {
+                return pw_h;
+            }
+            index = -1;
+            if (depth < context.size()) {
+                long k = Flat::search(_node_token_ids + node.children_begin, node.num_children, context.recent(depth));
+                if (k >= 0) {
+                    index = node.children_begin + k;
+                }
+            } else if (context.is_truncated() && node.num_children > 0) {
+                throw ScoringStateTooShort();
+            }
+            depth++;
+        }
+        // beyond the tree: sum_k p_pass * r_stop * r_pass^k = p_pass, all with Pw of the deepest node
+        pw_h += parent_pw * p_pass;
+        return pw_h;
+    }
+    // log Pw of `token_id` after the context of `state`, which `next_state` receives extended by `token_id`
+    double score(const BasicScoringState<IdT> &state, IdT token_id, BasicScoringState<IdT> &next_state) const {
+        double pw_h = compute_Pw_given_context(token_id, state);
+        next_state.extend(state, token_id);
+        return log(pw_h);
+    }
+    double compute_log_Pw(const vector<IdT> &token_ids) const {
+        if (token_ids.size() == 0) {
+            return 0;
+        }
+        double sum_pw_h = 0;
+        vector<IdT> context_token_ids(token_ids.begin(), token_ids.begin() + 1);
+        for (int t=1; t<token_ids.size(); ++t) {
+            IdT token_id = token_ids[t];
+            double pw_h = compute_Pw_given_h(token_id, context_token_ids);
+            sum_pw_h += log(pw_h);
+            context_token_ids.push_back(token_id);
+        }
+        return sum_pw_h;
+    }
+    double compute_log2_Pw(const vector<IdT> &token_ids) const {
+        if (token_ids.size() == 0) {
+            return 0;
+        }
+        double sum_pw_h = 0;
+        vector<IdT> context_token_ids(token_ids.begin(), token_ids.begin() + 1);
+        for (int t=1; t<token_ids.size(); ++t) {
+            IdT token_id = token_ids[t];
+            double pw_h = compute_Pw_given_h(token_id, context_token_ids);
+            sum_pw_h += log2(pw_h);
+            context_token_ids.push_back(token_id);
+        }
+        return sum_pw_h;
+    }
+    // as `BasicVPYLM::get_num_nodes`, without the root
+    int get_num_nodes() const {
+        return _header->num_nodes - 1;
+    }
+    int get_num_bits() const {
+        return _header->code_bytes * 8;
+    }
+    size_t get_num_bytes() const {
+        return _size;
+    }
+};
+
+using QuantizedVPYLM = BasicQuantizedVPYLM<id>;
@@ -1,30 +1,287 @@
 #pragma once
 #include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <limits>
 #include <random>
 using namespace std;
 
+#define SAMPLER_BUFFER_SIZE 256         // uniforms generated at once per thread
+
 namespace sampler {
+    inline uint64_t splitmix64(uint64_t &state) {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+    // xoshiro256++ by Blackman and Vigna; 256 bits of state, period 2^256 - 1
+    class Xoshiro256pp {
+    private:
+        uint64_t _s[4];
+
+        static uint64_t rotl(uint64_t x, int k) {
+            return (x << k) | (x >> (64 - k));
+        }
+    public:
+        using result_type = uint64_t;
+        static constexpr result_type min() {
+            return 0;
+        }
+        static constexpr result_type max() {
+            return std::numeric_limits<uint64_t>::max();
+        }
+        Xoshiro256pp(uint64_t seed_value=0) {
+            seed(seed_value);
+        }
+        // streams come from different seeds, expanded by splitmix64
+        Xoshiro256pp(uint64_t seed_value, uint64_t stream) {
+            seed(seed_value ^ splitmix64(stream));
+        }
+        void seed(uint64_t seed_value) {
+            for (int i=0; i<4; ++i) {
+                _s[i] = splitmix64(seed_value);
+            }
+        }
+        result_type operator()() {
+            uint64_t result = rotl(_s[0] + _s[3], 23) + _s[0];
+            uint64_t t = _s[1] << 17;
+            _s[2] ^= _s[0];
+            _s[3] ^= _s[1];
+            _s[1] ^= _s[2];
+            _s[0] ^= _s[3];
+            _s[2] ^= t;
+            _s[3] = rotl(_s[3], 45);
+            return result;
+        }
+    };
+    // Philox4x32-10 by Salmon et al.; the output is a bijection of a 128-bit counter under a 64-bit key
+    // the upper half of the counter holds the stream, so streams never overlap
+    class Philox4x32 {
+    private:
+        uint32_t _key[2];
+        uint32_t _counter[4];
+        uint32_t _output[4];
+        int _index;                 // next word of `_output`
+
+        static void mulhilo(uint32_t a, uint32_t b, uint32_t &hi, uint32_t &lo) {
+            uint64_t product = (uint64_t)a * b;
+            hi = product >> 32;
+            lo = (uint32_t)product;
+        }
+        void generate() {
+            uint32_t x[4] = {_counter[0], _counter[1], _counter[2], _counter[3]};
+            uint32_t k0 = _key[0];
+            uint32_t k1 = _key[1];
+            for (int round=0; round<10; ++round) {
+                uint32_t hi0, lo0, hi1, lo1;
+                mulhilo(0xD2511F53u, x[0], hi0, lo0);
+                mulhilo(0xCD9E8D57u, x[2], hi1, lo1);
+                x[0] = hi1 ^ x[1] ^ k0;
+                x[1] = lo1;
+                x[2] = hi0 ^ x[3] ^ k1;
+                x[3] = lo0;
+                k0 += 0x9E3779B9u;
+                k1 += 0xBB67AE85u;
+            }
+            for (int i=0; i<4; ++i) {
+                _output[i] = x[i];
+            }
+            // 64-bit block counter in the lower half
+            if (++_counter[0] == 0) {
+                ++_counter[1];
+            }
+        }
+    public:
+        using result_type = uint32_t;
+        static constexpr result_type min() {
+            return 0;
+        }
+        static constexpr result_type max() {
+            return std::numeric_limits<uint32_t>::max();
+        }
+        Philox4x32(uint64_t seed_value=0, uint64_t stream=0) {
+            seed(seed_value, stream);
+        }
+        void seed(uint64_t seed_value, uint64_t stream=0) {
+            _key[0] = (uint32_t)seed_value;
+            _key[1] = seed_value >> 32;
+            _counter[0] = 0;
+            _counter[1] = 0;
+            _counter[2] = (uint32_t)stream;
+            _counter[3] = stream >> 32;
+            _index = 4;
+        }
+        result_type operator()() {
+            if (_index == 4) {
+                generate();
+                _index = 0;
+            }
+            return _output[_index++];
+        }
+    };
+    // engine of the samplers below; xoshiro256++ unless VPYLM_RNG_PHILOX or VPYLM_RNG_MT19937 is defined
+    // `make_engine` gives the engine of one of many parallel streams
+#if defined(VPYLM_RNG_PHILOX)
+    using engine = Philox4x32;
+    inline engine make_engine(uint64_t seed_value, uint64_t stream) {
+        return engine(seed_value, stream);
+    }
+#elif defined(VPYLM_RNG_MT19937)
+    using engine = mt19937;
+    inline engine make_engine(uint64_t seed_value, uint64_t stream) {
+        return engine(seed_value ^ splitmix64(stream));
+    }
+#else
+    using engine = Xoshiro256pp;
+    inline engine make_engine(uint64_t seed_value, uint64_t stream) {
+        return engine(seed_value, stream);
+    }
+#endif
+    // uniform in [0, 1) with 53 random bits
+    template<typename EngineT>
+    double to_unit(EngineT &e) {
+        if (EngineT::max() - EngineT::min() == std::numeric_limits<uint64_t>::max()) {
+            return ((uint64_t)(e() - EngineT::min()) >> 11) * (1.0 / 9007199254740992.0);
+        }
+        // two 32-bit words
+        uint64_t a = (uint64_t)(e() - EngineT::min()) >> 5;
+        uint64_t b = (uint64_t)(e() - EngineT::min()) >> 6;
+        return (a * 67108864.0 + b) * (1.0 / 9007199254740992.0);
+    }
+    // uniforms of an engine generated SAMPLER_BUFFER_SIZE at a time
+    template<typename EngineT>
+    class UniformBuffer {
+    private:
+        double _values[SAMPLER_BUFFER_SIZE];
+        int _index;
+        EngineT *_engine;
+    public:
+        UniformBuffer() {
+            clear();
+        }
+        double next(EngineT *e) {
+            if (_index == SAMPLER_BUFFER_SIZE || _engine != e) {
+                for (int i=0; i<SAMPLER_BUFFER_SIZE; ++i) {
+                    _values[i] = to_unit(*e);
+                }
+                _index = 0;
+                _engine = e;
+            }
+            return _values[_index++];
+        }
+        void clear() {
+            _index = SAMPLER_BUFFER_SIZE;
+            _engine = NULL;
+        }
+    };
+
     int seed = chrono::system_clock::now().time_since_epoch().count();
-    mt19937 mt(seed);
-    double gamma(double a, double b) {
-        gamma_distribution<double> distribution(a, 1.0 / b);
-        return distribution(mt);
+    engine rng(seed);
+    // engine drawn from by the calling thread; `rng` unless an `EngineScope` is alive
+    engine *&current_engine() {
+        static thread_local engine *e = &rng;
+        return e;
     }
-    double beta(double a, double b) {
-        double ga = gamma(a, 1.0);
-        double gb = gamma(b, 1.0);
-        return ga / (ga + gb);
+    UniformBuffer<engine> &current_buffer() {
+        static thread_local UniformBuffer<engine> buffer;
+        return buffer;
+    }
+    // reseeds `rng` and drops the uniforms this thread has buffered
+    void set_seed(uint64_t seed_value) {
+        rng.seed(seed_value);
+        current_buffer().clear();
+    }
+    // routes the draws of this thread to `e` while alive
+    // `e` starts with an empty buffer, even if it reuses the address of another engine, and the uniforms buffered
+    // from the previous engine are set aside until the end, so that every engine yields the same draws whatever
+    // the others do, and whether or not the thread ran the scope at all
+    class EngineScope {
+    private:
+        engine *_prev;
+        UniformBuffer<engine> _prev_buffer;
+    public:
+        EngineScope(engine *e) {
+            _prev = current_engine();
+            _prev_buffer = current_buffer();
+            current_engine() = e;
+            current_buffer().clear();
+        }
+        ~EngineScope() {
+            current_engine() = _prev;
+            current_buffer() = _prev_buffer;
+        }
+    };
+    // uniform in [0, 1) from the buffer of this thread
+    double uniform01() {
+        return current_buffer().next(current_engine());
+    }
+    double uniform(double min=0, double max=0) {
+        return min + (max - min) * uniform01();
     }
     double bernoulli(double p) {
-        uniform_real_distribution<double> rand(0, 1);
-        double r = rand(mt);
+        double r = uniform01();
         if (r > p) {
             return 0;
         }
         return 1;
     }
-    double uniform(double min=0, double max=0) {
-        uniform_real_distribution<double> rand(min, max);
-        return rand(mt);
+    // standard normal by the polar method
+    double normal() {
+        while (true) {
+            double u = 2.0 * uniform01() - 1.0;
+            double v = 2.0 * uniform01() - 1.0;
+            double s = u * u + v * v;
+            if (s > 0 && s < 1) {
+                return u * sqrt(-2.0 * log(s) / s);
+            }
+        }
+    }
+    // shape `a` and rate `b`; Marsaglia and Tsang, boosted by u^(1/a) for a < 1
+    double gamma(double a, double b) {
+        if (a < 1) {
+            double u = uniform01();
+            return gamma(a + 1.0, b) * pow(u, 1.0 / a);
+        }
+        double d = a - 1.0 / 3.0;
+        double c = 1.0 / sqrt(9.0 * d);
+        while (true) {
+            double x, v;
+            do {
+                x = normal();
+                v = 1.0 + c * x;
+            } while (v <= 0);
+            v = v * v * v;
+            double u = uniform01();
+            if (u < 1.0 - 0.0331 * x * x * x * x || log(u) < 0.5 * x * x + d * (1.0 - v + log(v))) {
+                return d * v / b;
+            }
+        }
+    }
+    double beta(double a, double b) {
+        double ga = gamma(a, 1.0);
+        double gb = gamma(b, 1.0);
+        return ga / (ga + gb);
+    }
+    // inversion with a single uniform while n * p is small, which is the common case for auxiliary variables
+    int binomial(int n, double p) {
+        if (p > 0.5) {
+            return n - binomial(n, 1.0 - p);
+        }
+        if (n * p >= 16) {
+            binomial_distribution<int> distribution(n, p);
+            return distribution(*current_engine());
+        }
+        double q = 1.0 - p;
+        double prob = pow(q, n);
+        double cdf = prob;
+        double u = uniform01();
+        int x = 0;
+        while (u > cdf && x < n) {
+            prob *= p / q * (n - x) / (x + 1);
+            cdf += prob;
+            x++;
+        }
+        return x;
     }
-}
\ No newline at end of file
+}
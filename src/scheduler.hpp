@@ -0,0 +1,153 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "thread_pool.hpp"
+using namespace std;
+
+// time a worker of the scheduler spent on batches and waiting for the others, summed over its runs
+struct SchedulerStats {
+    double busy_sec;
+    double idle_sec;            // from the start of a run until the last worker finished it
+    long num_batches;
+    long num_stolen_batches;    // taken from the deque of another worker
+
+    SchedulerStats() {
+        clear();
+    }
+    void clear() {
+        busy_sec = 0;
+        idle_sec = 0;
+        num_batches = 0;
+        num_stolen_batches = 0;
+    }
+};
+
+// runs batches of items on a thread pool with work stealing
+// consecutive items are grouped into batches of about `batch_cost`, and runs of batches of about equal cost are dealt
+// to the deques of the workers; a worker takes batches from the front of its own deque, then from the back of others
+class WorkStealingScheduler {
+private:
+    struct WorkerQueue {
+        mutex _mutex;
+        deque<int> _batches;
+        char padding[64];       // keeps the deques of two workers off one cache line
+    };
+    vector<unique_ptr<WorkerQueue>> _queues;
+    vector<SchedulerStats> _stats;
+    vector<int> _batch_begins;  // batch k covers items [_batch_begins[k], _batch_begins[k + 1])
+
+    bool pop(int worker, int &batch) {
+        WorkerQueue &queue = *_queues[worker];
+        lock_guard<mutex> lock(queue._mutex);
+        if (queue._batches.empty()) {
+            return false;
+        }
+        batch = queue._batches.front();
+        queue._batches.pop_front();
+        return true;
+    }
+    bool steal(int worker, int &batch) {
+        for (int k=1; k<_queues.size(); ++k) {
+            WorkerQueue &queue = *_queues[(worker + k) % _queues.size()];
+            lock_guard<mutex> lock(queue._mutex);
+            if (queue._batches.empty() == false) {
+                batch = queue._batches.back();
+                queue._batches.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+    static double seconds_between(chrono::steady_clock::time_point start, chrono::steady_clock::time_point end) {
+        return chrono::duration_cast<chrono::duration<double>>(end - start).count();
+    }
+public:
+    WorkStealingScheduler(int num_threads) {
+        for (int worker=0; worker<num_threads; ++worker) {
+            _queues.push_back(unique_ptr<WorkerQueue>(new WorkerQueue()));
+        }
+        _stats.resize(num_threads);
+    }
+    WorkStealingScheduler(const WorkStealingScheduler &) = delete;
+    WorkStealingScheduler &operator=(const WorkStealingScheduler &) = delete;
+    int get_num_threads() {
+        return _queues.size();
+    }
+    vector<SchedulerStats> &get_stats() {
+        return _stats;
+    }
+    void clear_stats() {
+        for (auto &stats : _stats) {
+            stats.clear();
+        }
+    }
+    // runs `job(worker, batch, begin, end)` for items [begin, end) of every batch, on `pool` if given, and returns
+    // the number of batches; `costs` holds the cost of each item, and batches depend on them and `batch_cost` only,
+    // not on the number of threads
+    int run(ThreadPool *pool, const vector<int> &costs, int batch_cost, const function<void(int, int, int, int)> &job) {
+        _batch_begins.clear();
+        long total_cost = 0;
+        int cost = 0;
+        for (int i=0; i<costs.size(); ++i) {
+            if (cost == 0) {
+                _batch_begins.push_back(i);
+            }
+            cost += costs[i];
+            total_cost += costs[i];
+            if (cost >= batch_cost) {
+                cost = 0;
+            }
+        }
+        int num_batches = _batch_begins.size();
+        _batch_begins.push_back(costs.size());
+        int num_threads = _queues.size();
+        long cost_before = 0;
+        for (int batch=0; batch<num_batches; ++batch) {
+            int worker = total_cost == 0 ? 0 : std::min<long>(num_threads - 1, cost_before * num_threads / total_cost);
+            _queues[worker]->_batches.push_back(batch);
+            for (int i=_batch_begins[batch]; i<_batch_begins[batch + 1]; ++i) {
+                cost_before += costs[i];
+            }
+        }
+        vector<double> busy_secs(num_threads, 0);
+        vector<chrono::steady_clock::time_point> finish_times(num_threads);
+        auto start = chrono::steady_clock::now();
+        auto work = [&](int worker) {
+            SchedulerStats &stats = _stats[worker];
+            int batch;
+            while (true) {
+                bool stolen = false;
+                if (pop(worker, batch) == false) {
+                    if (steal(worker, batch) == false) {
+                        break;
+                    }
+                    stolen = true;
+                }
+                auto batch_start = chrono::steady_clock::now();
+                job(worker, batch, _batch_begins[batch], _batch_begins[batch + 1]);
+                busy_secs[worker] += seconds_between(batch_start, chrono::steady_clock::now());
+                stats.num_batches++;
+                if (stolen) {
+                    stats.num_stolen_batches++;
+                }
+            }
+            finish_times[worker] = chrono::steady_clock::now();
+        };
+        if (pool == NULL) {
+            work(0);
+        } else {
+            pool->run(work);
+        }
+        double run_sec = seconds_between(start, *std::max_element(finish_times.begin(), finish_times.end()));
+        for (int worker=0; worker<num_threads; ++worker) {
+            _stats[worker].busy_sec += busy_secs[worker];
+            _stats[worker].idle_sec += run_sec - busy_secs[worker];
+        }
+        return num_batches;
+    }
+};
@@ -0,0 +1,69 @@
+#pragma once
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "common.hpp"
+using namespace std;
+
+// context for scoring a stream token by token: the last VPYLM_SCORING_STATE_ORDER tokens, most recent first, in a
+// fixed array, so that a state is copied without allocation and extended in place
+// contexts are read by `size()` and `recent(n)`, the token n positions before the next one, and `is_truncated()`
+template<typename IdT>
+class BasicScoringState {
+public:
+    IdT _token_ids[VPYLM_SCORING_STATE_ORDER];
+    int _size;
+    bool _truncated;                // older tokens were dropped
+
+    BasicScoringState() {
+        _size = 0;
+        _truncated = false;
+    }
+    int size() const {
+        return _size;
+    }
+    IdT recent(int n) const {
+        return _token_ids[n];
+    }
+    bool is_truncated() const {
+        return _truncated;
+    }
+    // `state` followed by `token_id`; `state` may be this state
+    void extend(const BasicScoringState &state, IdT token_id) {
+        int size = std::min(state._size + 1, VPYLM_SCORING_STATE_ORDER);
+        _truncated = state._truncated || state._size == VPYLM_SCORING_STATE_ORDER;
+        for (int n=size-1; n>0; --n) {
+            _token_ids[n] = state._token_ids[n - 1];
+        }
+        _token_ids[0] = token_id;
+        _size = size;
+    }
+};
+
+// thrown when a walk down a tree reaches the oldest token of a truncated context at a node with children, where the
+// dropped tokens might have led deeper; the tree is deeper than VPYLM_SCORING_STATE_ORDER
+class ScoringStateTooShort : public std::runtime_error {
+public:
+    ScoringStateTooShort() : std::runtime_error("the tree is deeper than the " + std::to_string(VPYLM_SCORING_STATE_ORDER) + " tokens a scoring state keeps; score whole sentences instead") {}
+};
+
+// a whole history read like a scoring state
+template<typename IdT>
+class BasicContextView {
+private:
+    const vector<IdT> &_token_ids;
+public:
+    BasicContextView(const vector<IdT> &token_ids) : _token_ids(token_ids) {}
+    int size() const {
+        return _token_ids.size();
+    }
+    IdT recent(int n) const {
+        return _token_ids[_token_ids.size() - n - 1];
+    }
+    bool is_truncated() const {
+        return false;
+    }
+};
+
+using ScoringState = BasicScoringState<id>;
@@ -0,0 +1,230 @@
+#pragma once
+#include <boost/serialization/serialization.hpp>
+#include <boost/serialization/split_member.hpp>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include "hashmap.hpp"
+#include "allocator.hpp"
+using namespace std;
+
+// map keeping up to N entries inline, sorted by key, and switching to an open-addressing hash map past N
+// most context nodes have few children and serve few words, so they never touch the hash map
+template<typename KeyT, typename ValueT, int N>
+class SmallMap {
+public:
+    using PairT = std::pair<KeyT, ValueT>;
+    using MapT = emilib::HashMap<KeyT, ValueT, std::hash<KeyT>, emilib::HashMapEqualTo<KeyT>, SlabAllocation>;
+
+    template<typename P, typename MapItrT>
+    class basic_iterator {
+    public:
+        P *_ptr;            // inline entry
+        MapItrT _itr;       // entry of the hash map
+        bool _large;
+
+        basic_iterator(P *ptr) : _ptr(ptr), _large(false) {
+        }
+        basic_iterator(MapItrT itr) : _ptr(NULL), _itr(itr), _large(true) {
+        }
+        P &operator*() const {
+            return _large ? *_itr : *_ptr;
+        }
+        P *operator->() const {
+            return _large ? &(*_itr) : _ptr;
+        }
+        basic_iterator &operator++() {
+            if (_large) {
+                ++_itr;
+            } else {
+                ++_ptr;
+            }
+            return *this;
+        }
+        bool operator==(const basic_iterator &other) const {
+            if (_large) {
+                MapItrT itr = _itr;     // emilib iterators compare through non-const members
+                return itr == other._itr;
+            }
+            return _ptr == other._ptr;
+        }
+        bool operator!=(const basic_iterator &other) const {
+            return !(*this == other);
+        }
+    };
+    using iterator = basic_iterator<PairT, typename MapT::iterator>;
+    using const_iterator = basic_iterator<const PairT, typename MapT::const_iterator>;
+private:
+    int _size;      // num of inline entries, -1 once entries live in `_map`
+    union {
+        typename std::aligned_storage<sizeof(PairT), alignof(PairT)>::type _storage[N];
+        MapT *_map;
+    };
+
+    PairT *entries() {
+        return reinterpret_cast<PairT*>(_storage);
+    }
+    const PairT *entries() const {
+        return reinterpret_cast<const PairT*>(_storage);
+    }
+    // position of the first inline entry whose key is not less than `key`
+    // slots past `_size` hold no object, so they are never read; N is small enough for the loop to be unrolled
+    int lower_bound(const KeyT &key) const {
+        const PairT *pairs = entries();
+        int pos = 0;
+        for (int k=0; k<_size; ++k) {
+            pos += pairs[k].first < key;
+        }
+        return pos;
+    }
+    void move_to_map() {
+        MapT *map = new (SlabAllocator::allocate(sizeof(MapT))) MapT();
+        map->reserve(N + 1);
+        PairT *pairs = entries();
+        for (int k=0; k<_size; ++k) {
+            map->insert_unique(std::move(pairs[k].first), std::move(pairs[k].second));
+            pairs[k].~PairT();
+        }
+        _map = map;
+        _size = -1;
+    }
+    void move_to_inline() {
+        MapT *map = _map;
+        _size = 0;
+        PairT *pairs = entries();
+        for (auto &elem : *map) {
+            int pos = lower_bound(elem.first);
+            for (int k=_size; k>pos; --k) {
+                new (&pairs[k]) PairT(std::move(pairs[k - 1]));
+                pairs[k - 1].~PairT();
+            }
+            new (&pairs[pos]) PairT(std::move(elem));
+            _size++;
+        }
+        map->~MapT();
+        SlabAllocator::deallocate(map, sizeof(MapT));
+    }
+public:
+    SmallMap() {
+        _size = 0;
+    }
+    SmallMap(const SmallMap &) = delete;
+    SmallMap &operator=(const SmallMap &) = delete;
+    ~SmallMap() {
+        clear();
+    }
+    bool is_inline() const {
+        return _size >= 0;
+    }
+    size_t size() const {
+        return is_inline() ? _size : _map->size();
+    }
+    bool empty() const {
+        return size() == 0;
+    }
+    iterator begin() {
+        return is_inline() ? iterator(entries()) : iterator(_map->begin());
+    }
+    iterator end() {
+        return is_inline() ? iterator(entries() + _size) : iterator(_map->end());
+    }
+    const_iterator begin() const {
+        return is_inline() ? const_iterator(entries()) : const_iterator(static_cast<const MapT*>(_map)->begin());
+    }
+    const_iterator end() const {
+        return is_inline() ? const_iterator(entries() + _size) : const_iterator(static_cast<const MapT*>(_map)->end());
+    }
+    iterator find(const KeyT &key) {
+        if (!is_inline()) {
+            return iterator(_map->find(key));
+        }
+        int pos = lower_bound(key);
+        if (pos < _size && entries()[pos].first == key) {
+            return iterator(entries() + pos);
+        }
+        return end();
+    }
+    size_t count(const KeyT &key) {
+        return find(key) == end() ? 0 : 1;
+    }
+    ValueT &operator[](const KeyT &key) {
+        if (!is_inline()) {
+            return (*_map)[key];
+        }
+        PairT *pairs = entries();
+        int pos = lower_bound(key);
+        if (pos < _size && pairs[pos].first == key) {
+            return pairs[pos].second;
+        }
+        if (_size == N) {
+            move_to_map();
+            return (*_map)[key];
+        }
+        for (int k=_size; k>pos; --k) {
+            new (&pairs[k]) PairT(std::move(pairs[k - 1]));
+            pairs[k - 1].~PairT();
+        }
+        new (&pairs[pos]) PairT(key, ValueT());
+        _size++;
+        return pairs[pos].second;
+    }
+    bool erase(const KeyT &key) {
+        if (!is_inline()) {
+            bool erased = _map->erase(key);
+            // come back inline well below the threshold to avoid flapping
+            if (_map->size() <= N / 2) {
+                move_to_inline();
+            }
+            return erased;
+        }
+        PairT *pairs = entries();
+        int pos = lower_bound(key);
+        if (pos >= _size || !(pairs[pos].first == key)) {
+            return false;
+        }
+        pairs[pos].~PairT();
+        for (int k=pos; k<_size-1; ++k) {
+            new (&pairs[k]) PairT(std::move(pairs[k + 1]));
+            pairs[k + 1].~PairT();
+        }
+        _size--;
+        return true;
+    }
+    void clear() {
+        if (is_inline()) {
+            PairT *pairs = entries();
+            for (int k=0; k<_size; ++k) {
+                pairs[k].~PairT();
+            }
+        } else {
+            _map->~MapT();
+            SlabAllocator::deallocate(_map, sizeof(MapT));
+        }
+        _size = 0;
+    }
+    // same layout as emilib::HashMap, so model files do not depend on the representation
+    template <class Archive>
+    void save(Archive &archive, unsigned int version) const {
+        size_t map_size = size();
+        archive & map_size;
+        for (const PairT &elem : *this) {
+            archive & elem.first;
+            archive & elem.second;
+        }
+    }
+    template <class Archive>
+    void load(Archive &archive, unsigned int version) {
+        size_t map_size = 0;
+        archive & map_size;
+        clear();
+        for (size_t i=0; i<map_size; ++i) {
+            KeyT key;
+            ValueT value;
+            archive & key;
+            archive & value;
+            (*this)[key] = std::move(value);
+        }
+    }
+    BOOST_SERIALIZATION_SPLIT_MEMBER()
+};
@@ -0,0 +1,491 @@
+#pragma once
+#include <boost/serialization/serialization.hpp>
+#include <boost/serialization/split_member.hpp>
+#include <boost/serialization/level.hpp>
+#include <boost/serialization/tracking.hpp>
+#include <boost/serialization/vector.hpp>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <limits>
+#include <new>
+#include <type_traits>
+#include <vector>
+#include "allocator.hpp"
+using namespace std;
+
+// growable array of trivially copyable values; the first element is stored inline
+template<typename T>
+class SmallVector {
+    static_assert(std::is_trivially_copyable<T>::value, "SmallVector requires trivially copyable values");
+public:
+    int _size;
+    int _capacity;   // 1 while the element is stored inline
+    union {
+        T _inline;
+        T *_heap;
+    };
+
+    SmallVector() {
+        _size = 0;
+        _capacity = 1;
+        _heap = NULL;
+    }
+    SmallVector(const SmallVector &other) {
+        _size = 0;
+        _capacity = 1;
+        _heap = NULL;
+        *this = other;
+    }
+    SmallVector(SmallVector &&other) noexcept {
+        std::memcpy(this, &other, sizeof(SmallVector));
+        other._size = 0;
+        other._capacity = 1;
+    }
+    SmallVector &operator=(const SmallVector &other) {
+        if (this == &other) {
+            return *this;
+        }
+        clear();
+        reserve(other._size);
+        std::memcpy(data(), other.data(), other._size * sizeof(T));
+        _size = other._size;
+        return *this;
+    }
+    SmallVector &operator=(SmallVector &&other) noexcept {
+        if (this != &other) {
+            clear();
+            std::memcpy(this, &other, sizeof(SmallVector));
+            other._size = 0;
+            other._capacity = 1;
+        }
+        return *this;
+    }
+    ~SmallVector() {
+        clear();
+    }
+    T *data() {
+        return _capacity == 1 ? &_inline : _heap;
+    }
+    const T *data() const {
+        return _capacity == 1 ? &_inline : _heap;
+    }
+    int size() const {
+        return _size;
+    }
+    T &operator[](int i) {
+        return data()[i];
+    }
+    const T &operator[](int i) const {
+        return data()[i];
+    }
+    T *begin() {
+        return data();
+    }
+    T *end() {
+        return data() + _size;
+    }
+    const T *begin() const {
+        return data();
+    }
+    const T *end() const {
+        return data() + _size;
+    }
+    void reserve(int capacity) {
+        if (capacity <= _capacity) {
+            return;
+        }
+        T *heap = (T*)SlabAllocator::allocate(capacity * sizeof(T));
+        std::memcpy(heap, data(), _size * sizeof(T));
+        if (_capacity > 1) {
+            SlabAllocator::deallocate(_heap, _capacity * sizeof(T));
+        }
+        _heap = heap;
+        _capacity = capacity;
+    }
+    void push_back(const T &value) {
+        if (_size == _capacity) {
+            reserve(_capacity * 2);
+        }
+        data()[_size++] = value;
+    }
+    void insert(int i, const T &value) {
+        if (_size == _capacity) {
+            reserve(_capacity * 2);
+        }
+        T *values = data();
+        std::memmove(values + i + 1, values + i, (_size - i) * sizeof(T));
+        values[i] = value;
+        _size++;
+    }
+    void erase(int i) {
+        T *values = data();
+        std::memmove(values + i, values + i + 1, (_size - i - 1) * sizeof(T));
+        _size--;
+        // move back inline once a single element is left
+        if (_size <= 1 && _capacity > 1) {
+            T *heap = _heap;
+            if (_size == 1) {
+                _inline = heap[0];
+            }
+            SlabAllocator::deallocate(heap, _capacity * sizeof(T));
+            _capacity = 1;
+        }
+    }
+    void clear() {
+        if (_capacity > 1) {
+            SlabAllocator::deallocate(_heap, _capacity * sizeof(T));
+        }
+        _size = 0;
+        _capacity = 1;
+    }
+};
+
+// seating arrangement of the customers eating one word in a restaurant
+// c_uw and t_uw are kept alongside the table counts so that probability queries never touch the tables
+// tables are grouped into bins of equal size; here every table is a bin of its own
+// counts are stored as CountT, and as int once a table outgrows CountT; as many counts as fit in a pointer are stored inline
+template<typename CountT>
+class Tables {
+    static_assert(std::is_integral<CountT>::value && sizeof(CountT) <= sizeof(int), "Tables requires an integral count type no wider than int");
+private:
+    static const int INLINE_BYTES = sizeof(void*);
+    int _num_customers;             // c_uw
+    uint32_t _num_tables : 26;      // t_uw
+    uint32_t _log2_capacity : 5;    // `_heap` holds 1 << _log2_capacity counts; 0 while counts are inline
+    uint32_t _wide : 1;             // counts are stored as int
+    union {
+        char _inline[INLINE_BYTES];
+        void *_heap;
+    };
+
+    int width() const {
+        return _wide ? sizeof(int) : sizeof(CountT);
+    }
+    int capacity() const {
+        return _log2_capacity == 0 ? INLINE_BYTES / width() : 1 << _log2_capacity;
+    }
+    const void *data() const {
+        return _log2_capacity == 0 ? (const void*)_inline : _heap;
+    }
+    void *data() {
+        return _log2_capacity == 0 ? (void*)_inline : _heap;
+    }
+    void set(int table_k, int count) {
+        if (_wide) {
+            ((int*)data())[table_k] = count;
+        } else {
+            ((CountT*)data())[table_k] = (CountT)count;
+        }
+    }
+    void free_heap() {
+        if (_log2_capacity > 0) {
+            SlabAllocator::deallocate(_heap, (size_t)width() << _log2_capacity);
+        }
+    }
+    // moves the counts to storage for at least `min_capacity` counts, stored as int if `wide`
+    void reallocate(int min_capacity, bool wide) {
+        int num_tables = _num_tables;
+        int counts[INLINE_BYTES];   // enough for counts that fit inline
+        void *heap = NULL;
+        int log2_capacity = 0;
+        if (min_capacity * (wide ? sizeof(int) : sizeof(CountT)) > INLINE_BYTES) {
+            log2_capacity = 1;
+            while ((1 << log2_capacity) < min_capacity) {
+                log2_capacity++;
+            }
+            heap = SlabAllocator::allocate((wide ? sizeof(int) : sizeof(CountT)) << log2_capacity);
+            for (int k=0; k<num_tables; ++k) {
+                if (wide) {
+                    ((int*)heap)[k] = (*this)[k];
+                } else {
+                    ((CountT*)heap)[k] = (CountT)(*this)[k];
+                }
+            }
+        } else {
+            for (int k=0; k<num_tables; ++k) {
+                counts[k] = (*this)[k];
+            }
+        }
+        free_heap();
+        _wide = wide;
+        _log2_capacity = log2_capacity;
+        if (heap) {
+            _heap = heap;
+        } else {
+            for (int k=0; k<num_tables; ++k) {
+                set(k, counts[k]);
+            }
+        }
+    }
+public:
+    Tables() {
+        _num_customers = 0;
+        _num_tables = 0;
+        _log2_capacity = 0;
+        _wide = 0;
+        _heap = NULL;
+    }
+    Tables(const Tables &other) : Tables() {
+        *this = other;
+    }
+    Tables(Tables &&other) noexcept {
+        std::memcpy(this, &other, sizeof(Tables));
+        other._num_customers = 0;
+        other._num_tables = 0;
+        other._log2_capacity = 0;
+        other._wide = 0;
+    }
+    Tables &operator=(const Tables &other) {
+        if (this == &other) {
+            return *this;
+        }
+        free_heap();
+        _num_customers = 0;
+        _num_tables = 0;
+        _log2_capacity = 0;
+        _wide = other._wide;
+        reallocate(other._num_tables, other._wide);
+        for (int k=0; k<other._num_tables; ++k) {
+            set(k, other[k]);
+        }
+        _num_customers = other._num_customers;
+        _num_tables = other._num_tables;
+        return *this;
+    }
+    Tables &operator=(Tables &&other) noexcept {
+        if (this != &other) {
+            free_heap();
+            std::memcpy(this, &other, sizeof(Tables));
+            other._num_customers = 0;
+            other._num_tables = 0;
+            other._log2_capacity = 0;
+            other._wide = 0;
+        }
+        return *this;
+    }
+    ~Tables() {
+        free_heap();
+    }
+    int num_customers() const {
+        return _num_customers;
+    }
+    int num_tables() const {
+        return _num_tables;
+    }
+    int size() const {
+        return _num_tables;
+    }
+    int operator[](int table_k) const {
+        return _wide ? ((const int*)data())[table_k] : ((const CountT*)data())[table_k];
+    }
+    int num_bins() const {
+        return _num_tables;
+    }
+    int bin_size(int bin_k) const {
+        return (*this)[bin_k];
+    }
+    int bin_tables(int bin_k) const {
+        return 1;
+    }
+    void add_customer_to_table(int table_k) {
+        int count = (*this)[table_k] + 1;
+        if (_wide == false && count > std::numeric_limits<CountT>::max()) {
+            reallocate(_num_tables, true);
+        }
+        set(table_k, count);
+        _num_customers++;
+    }
+    void add_customer_to_new_table() {
+        if (_num_tables == capacity()) {
+            reallocate(_num_tables + 1, _wide);
+        }
+        set(_num_tables, 1);
+        _num_tables++;
+        _num_customers++;
+    }
+    // returns true if the table becomes empty and is removed
+    bool remove_customer_from_table(int table_k) {
+        int count = (*this)[table_k] - 1;
+        assert(count >= 0);
+        _num_customers--;
+        if (count > 0) {
+            set(table_k, count);
+            return false;
+        }
+        char *bytes = (char*)data();
+        std::memmove(bytes + table_k * width(), bytes + (table_k + 1) * width(), (_num_tables - table_k - 1) * width());
+        _num_tables--;
+        // shrink once a quarter of the heap array is used
+        if (_log2_capacity > 0 && _num_tables <= capacity() / 4) {
+            reallocate(_num_tables * 2, _wide);
+        }
+        return true;
+    }
+    // stored as vector<int>, the same format as the former per-word table vector
+    template <class Archive>
+    void save(Archive &archive, unsigned int version) const {
+        vector<int> counts;
+        for (int k=0; k<_num_tables; ++k) {
+            counts.push_back((*this)[k]);
+        }
+        const vector<int> &const_counts = counts;
+        archive & const_counts;
+    }
+    template <class Archive>
+    void load(Archive &archive, unsigned int version) {
+        vector<int> counts;
+        archive & counts;
+        *this = Tables();
+        bool wide = false;
+        for (int count : counts) {
+            wide = wide || count > std::numeric_limits<CountT>::max();
+        }
+        reallocate(counts.size(), wide);
+        for (int count : counts) {
+            set(_num_tables, count);
+            _num_tables++;
+            _num_customers += count;
+        }
+    }
+    BOOST_SERIALIZATION_SPLIT_MEMBER()
+};
+// no class header, so that model files keep the plain vector<int> layout
+namespace boost { namespace serialization {
+template<typename CountT>
+struct implementation_level_impl<const Tables<CountT>> {
+    typedef mpl::integral_c_tag tag;
+    typedef mpl::int_<object_serializable> type;
+    BOOST_STATIC_CONSTANT(int, value = implementation_level_impl::type::value);
+};
+template<typename CountT>
+struct tracking_level<Tables<CountT>> {
+    typedef mpl::integral_c_tag tag;
+    typedef mpl::int_<track_never> type;
+    BOOST_STATIC_CONSTANT(int, value = tracking_level::type::value);
+};
+}}
+
+struct TableBin {
+    int size;           // num of customers at each table
+    int num_tables;
+};
+
+// histogram of table sizes of the customers eating one word
+// seating only has to choose a bin, so frequent words with thousands of tables cost O(distinct table sizes)
+class TableHistogram {
+private:
+    void add_table_of_size(int size) {
+        int k = 0;
+        while (k < _bins.size() && _bins[k].size > size) {
+            k++;
+        }
+        if (k < _bins.size() && _bins[k].size == size) {
+            _bins[k].num_tables++;
+            return;
+        }
+        _bins.insert(k, TableBin{size, 1});
+    }
+public:
+    int _num_customers;             // c_uw
+    int _num_tables;                // t_uw
+    SmallVector<TableBin> _bins;    // sorted by size in descending order, so that scans meet the heavy bins first
+
+    TableHistogram() {
+        _num_customers = 0;
+        _num_tables = 0;
+    }
+    int num_customers() const {
+        return _num_customers;
+    }
+    int num_tables() const {
+        return _num_tables;
+    }
+    int size() const {
+        return _num_tables;
+    }
+    int num_bins() const {
+        return _bins.size();
+    }
+    int bin_size(int bin_k) const {
+        return _bins[bin_k].size;
+    }
+    int bin_tables(int bin_k) const {
+        return _bins[bin_k].num_tables;
+    }
+    // one of the tables in bin `bin_k` gets a customer
+    void add_customer_to_table(int bin_k) {
+        int size = _bins[bin_k].size;
+        // bins are sorted, so the bin of size + 1 can only be the previous one
+        if (bin_k > 0 && _bins[bin_k - 1].size == size + 1) {
+            _bins[bin_k - 1].num_tables++;
+        } else {
+            _bins.insert(bin_k, TableBin{size + 1, 1});
+            bin_k++;
+        }
+        _bins[bin_k].num_tables--;
+        if (_bins[bin_k].num_tables == 0) {
+            _bins.erase(bin_k);
+        }
+        _num_customers++;
+    }
+    void add_customer_to_new_table() {
+        add_table_of_size(1);
+        _num_tables++;
+        _num_customers++;
+    }
+    // returns true if the table becomes empty and is removed
+    bool remove_customer_from_table(int bin_k) {
+        int size = _bins[bin_k].size;
+        assert(size > 0);
+        _num_customers--;
+        if (size == 1) {
+            _num_tables--;
+        } else if (bin_k + 1 < _bins.size() && _bins[bin_k + 1].size == size - 1) {
+            _bins[bin_k + 1].num_tables++;
+        } else {
+            _bins.insert(bin_k + 1, TableBin{size - 1, 1});
+        }
+        _bins[bin_k].num_tables--;
+        if (_bins[bin_k].num_tables == 0) {
+            _bins.erase(bin_k);
+        }
+        return size == 1;
+    }
+    // stored as the per-table counts, so model files do not depend on the representation
+    template <class Archive>
+    void save(Archive &archive, unsigned int version) const {
+        vector<int> counts;
+        for (const TableBin &bin : _bins) {
+            counts.insert(counts.end(), bin.num_tables, bin.size);
+        }
+        const vector<int> &const_counts = counts;
+        archive & const_counts;
+    }
+    template <class Archive>
+    void load(Archive &archive, unsigned int version) {
+        vector<int> counts;
+        archive & counts;
+        _bins.clear();
+        _num_customers = 0;
+        _num_tables = 0;
+        for (int count : counts) {
+            add_table_of_size(count);
+            _num_customers += count;
+            _num_tables++;
+        }
+    }
+    BOOST_SERIALIZATION_SPLIT_MEMBER()
+};
+BOOST_CLASS_IMPLEMENTATION(TableHistogram, boost::serialization::object_serializable)
+BOOST_CLASS_TRACKING(TableHistogram, boost::serialization::track_never)
+
+// seating record of one word for per-table counts of type CountT
+#ifdef VPYLM_TABLE_HISTOGRAM
+template<typename CountT>
+using basic_table_record = TableHistogram;     // bins hold int counts whatever CountT is
+#else
+template<typename CountT>
+using basic_table_record = Tables<CountT>;
+#endif
@@ -0,0 +1,82 @@
+#pragma once
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+using namespace std;
+
+// fixed set of threads running one job at a time; the calling thread takes part as worker 0
+class ThreadPool {
+private:
+    vector<thread> _threads;
+    mutex _mutex;
+    condition_variable _job_ready;
+    condition_variable _job_done;
+    const function<void(int)> *_job;
+    long _generation;       // incremented for every job
+    int _num_running;       // threads other than the caller still on the current job
+    bool _stopping;
+
+    void work(int worker) {
+        long generation = 0;
+        while (true) {
+            const function<void(int)> *job;
+            {
+                unique_lock<mutex> lock(_mutex);
+                _job_ready.wait(lock, [&] { return _stopping || _generation != generation; });
+                if (_stopping) {
+                    return;
+                }
+                generation = _generation;
+                job = _job;
+            }
+            (*job)(worker);
+            {
+                lock_guard<mutex> lock(_mutex);
+                _num_running--;
+                if (_num_running == 0) {
+                    _job_done.notify_one();
+                }
+            }
+        }
+    }
+public:
+    ThreadPool(int num_threads) {
+        _job = NULL;
+        _generation = 0;
+        _num_running = 0;
+        _stopping = false;
+        for (int worker=1; worker<num_threads; ++worker) {
+            _threads.push_back(thread(&ThreadPool::work, this, worker));
+        }
+    }
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+    ~ThreadPool() {
+        {
+            lock_guard<mutex> lock(_mutex);
+            _stopping = true;
+        }
+        _job_ready.notify_all();
+        for (thread &t : _threads) {
+            t.join();
+        }
+    }
+    int get_num_threads() {
+        return _threads.size() + 1;
+    }
+    // runs `job(worker)` for every worker = 0, ..., num_threads - 1 in parallel and returns once all are done
+    void run(const function<void(int)> &job) {
+        {
+            lock_guard<mutex> lock(_mutex);
+            _job = &job;
+            _num_running = _threads.size();
+            _generation++;
+        }
+        _job_ready.notify_all();
+        job(0);
+        unique_lock<mutex> lock(_mutex);
+        _job_done.wait(lock, [&] { return _num_running == 0; });
+    }
+};
@@ -1,11 +1,16 @@
 #pragma once
 #include <boost/serialization/serialization.hpp>
+#include <boost/serialization/split_member.hpp>
+#include <boost/serialization/version.hpp>
 #include <boost/archive/binary_iarchive.hpp>
 #include <boost/archive/binary_oarchive.hpp>
 #include <boost/serialization/unordered_set.hpp>
 #include <boost/serialization/unordered_map.hpp>
 #include <boost/serialization/map.hpp>
 #include <boost/serialization/vector.hpp>
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
 #include <unordered_map>
 #include <unordered_set>
 #include <map>
@@ -16,45 +21,114 @@
 
 using namespace std;
 
+// characters of an interned word; valid until the next word is added
+struct WordView {
+    const wchar_t *data;
+    int length;
+};
+
+// interns words into dense ids; ID_BOS and ID_EOS come first, then words in order of appearance
 class Vocab {
 private:
-    unordered_set<id> _token_ids;
-    unordered_map<id, wstring> _string_by_token_id;
-    hash<wstring> _hash_func;
+    vector<wchar_t> _arena;     // all words back to back, each terminated by L'\0'
+    vector<int> _offsets;       // start of each word in `_arena` indexed by id, plus the end of the arena
+    vector<id> _slots;          // open-addressing table of ids hashed by their word, ID_UNKNOWN if empty
+    unordered_map<uint64_t, id> _loaded_token_ids;  // ids in the last loaded file mapped to ids here, if they differ
+
+    static uint64_t hash_chars(const wchar_t *chars, int length) {
+        // FNV-1a
+        uint64_t hash = 14695981039346656037ULL;
+        for (int i=0; i<length; ++i) {
+            hash ^= (uint64_t)chars[i];
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+    bool word_equals(id token_id, const wchar_t *chars, int length) {
+        WordView word = token_id_to_view(token_id);
+        return word.length == length && std::equal(chars, chars + length, word.data);
+    }
+    // slot holding `chars`, or the empty slot where it would go
+    size_t find_slot(const wchar_t *chars, int length) {
+        size_t mask = _slots.size() - 1;
+        size_t slot = hash_chars(chars, length) & mask;
+        while (_slots[slot] != ID_UNKNOWN && word_equals(_slots[slot], chars, length) == false) {
+            slot = (slot + 1) & mask;
+        }
+        return slot;
+    }
+    void rehash(size_t num_slots) {
+        _slots.assign(num_slots, ID_UNKNOWN);
+        for (id token_id=0; token_id<num_tokens(); ++token_id) {
+            WordView word = token_id_to_view(token_id);
+            _slots[find_slot(word.data, word.length)] = token_id;
+        }
+    }
+    id intern(const wchar_t *chars, int length) {
+        if (2 * (num_tokens() + 1) > _slots.size()) {
+            rehash(std::max<size_t>(16, _slots.size() * 2));
+        }
+        size_t slot = find_slot(chars, length);
+        if (_slots[slot] != ID_UNKNOWN) {
+            return _slots[slot];
+        }
+        id token_id = num_tokens();
+        _arena.insert(_arena.end(), chars, chars + length);
+        _arena.push_back(L'\0');
+        _offsets.push_back(_arena.size());
+        _slots[slot] = token_id;
+        return token_id;
+    }
+    void clear() {
+        _arena.clear();
+        _offsets.assign(1, 0);
+        _slots.clear();
+    }
+    void add_special_tokens() {
+        id bos = add_string(L"<bos>");
+        id eos = add_string(L"<eos>");
+        assert(bos == ID_BOS && eos == ID_EOS);
+    }
 public:
     Vocab() {
-        _string_by_token_id[ID_BOS] = L"<bos>";
-        _string_by_token_id[ID_EOS] = L"<eos>";
-        _token_ids.insert(ID_BOS);
-        _token_ids.insert(ID_EOS);
-    }
-    id add_string(wstring &str) {
-        id token_id = string_to_token_id(str);
-        _string_by_token_id[token_id] = str;
-        _token_ids.insert(token_id);
-        return token_id;
+        clear();
+        add_special_tokens();
+    }
+    id add_string(const wstring &str) {
+        return intern(str.data(), str.size());
     }
-    id string_to_token_id(wstring &str) {
-        return (id)_hash_func(str);
+    // ID_UNKNOWN for a word never added
+    id string_to_token_id(const wstring &str) {
+        if (_slots.size() == 0) {
+            return ID_UNKNOWN;
+        }
+        return _slots[find_slot(str.data(), str.size())];
     }
-    unordered_set<id> &get_all_token_ids() {
-        return _token_ids;
+    WordView token_id_to_view(id token_id) {
+        int offset = _offsets[token_id];
+        return WordView{_arena.data() + offset, _offsets[token_id + 1] - offset - 1};
     }
     wstring token_id_to_string(id token_id) {
-        auto itr = _string_by_token_id.find(token_id);
-        return itr->second;
+        WordView word = token_id_to_view(token_id);
+        return wstring(word.data, word.length);
     }
     wstring token_ids_to_sentence(vector<id> &token_ids) {
         wstring sentence = L"";
         for (const auto &token_id : token_ids) {
-            wstring word = token_id_to_string(token_id);
-            sentence += word;
+            WordView word = token_id_to_view(token_id);
+            sentence.append(word.data, word.length);
             sentence += L" ";
         }
         return sentence;
     }
+    // ids are 0, 1, ..., num_tokens() - 1
     int num_tokens() {
-        return _string_by_token_id.size();
+        return _offsets.size() - 1;
+    }
+    // ids in the last loaded file mapped to ids of this vocabulary; empty if they are the same
+    // files written before dense ids always need the map, their ids were hashes of the words
+    unordered_map<uint64_t, id> &get_loaded_token_ids() {
+        return _loaded_token_ids;
     }
     void save(string filename="vpylm.vocab") {
         std::ofstream ofs(filename);
@@ -62,11 +136,42 @@ public:
         oarchive << *this;
     }
     template <class Archive>
-    void serialize(Archive &archive, unsigned int version) {
-        static_cast<void>(version);
-        archive & _string_by_token_id;
-        archive & _token_ids;
+    void save(Archive &archive, unsigned int version) const {
+        archive & _arena;
+        archive & _offsets;
+    }
+    // words of the file are added to this vocabulary, so data added before loading keeps its ids
+    template <class Archive>
+    void load(Archive &archive, unsigned int version) {
+        _loaded_token_ids.clear();
+        if (version == 0) {
+            // ids used to be std::hash<wstring> values; words get dense ids in order of the old ones
+            unordered_map<uint64_t, wstring> string_by_token_id;
+            unordered_set<uint64_t> token_ids;
+            archive & string_by_token_id;
+            archive & token_ids;
+            map<uint64_t, wstring> sorted(string_by_token_id.begin(), string_by_token_id.end());
+            for (auto &elem : sorted) {
+                bool special = elem.first == ID_BOS || elem.first == ID_EOS;
+                _loaded_token_ids[elem.first] = special ? (id)elem.first : add_string(elem.second);
+            }
+            return;
+        }
+        vector<wchar_t> arena;
+        vector<int> offsets;
+        archive & arena;
+        archive & offsets;
+        bool identity = true;
+        for (int token_id=0; token_id+1<offsets.size(); ++token_id) {
+            id new_token_id = intern(arena.data() + offsets[token_id], offsets[token_id + 1] - offsets[token_id] - 1);
+            _loaded_token_ids[token_id] = new_token_id;
+            identity = identity && new_token_id == token_id;
+        }
+        if (identity) {
+            _loaded_token_ids.clear();
+        }
     }
+    BOOST_SERIALIZATION_SPLIT_MEMBER()
     void load(string filename="vpylm.vocab") {
         std::ifstream ifs(filename);
         if (ifs.good()) {
@@ -75,3 +180,4 @@ public:
         }
     }
 };
+BOOST_CLASS_VERSION(Vocab, 1)
@@ -1,5 +1,6 @@
 #pragma once
 #include <boost/serialization/serialization.hpp>
+#include <boost/serialization/version.hpp>
 #include <boost/serialization/base_object.hpp>
 #include <boost/archive/binary_iarchive.hpp>
 #include <boost/archive/binary_oarchive.hpp>
@@ -7,14 +8,34 @@
 #include <unordered_map> 
 #include <unordered_set>
 #include <vector>
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <stdexcept>
+#include <string>
 #include <fstream>
+#include <functional>
+#include <queue>
 #include "sampler.hpp"
 #include "common.hpp"
 #include "node.hpp"
+#include "delta.hpp"
+#include "thread_pool.hpp"
+#include "scoring_state.hpp"
+#include "context_cache.hpp"
 
-class VPYLM {
+template<typename IdT, typename CountT>
+class BasicVPYLM {
 public:
+    using Node = BasicNode<IdT, CountT>;
+    using table_record = typename Node::table_record;
+    using TreeDelta = BasicTreeDelta<IdT, CountT>;
+    using ScoringState = BasicScoringState<IdT>;
+    using ContextCache = BasicContextCache<IdT, Node>;
+    using ContextPath = typename ContextCache::ContextPath;
+
+    // owns the memory of nodes and their tables; declared first so that it outlives them
+    SlabAllocator _allocator;
     Node *_root;
     int _depth;
     double _g0;                  // 0-gram probabiliry
@@ -29,53 +50,221 @@ public:
     double _beta_stop;
     double _beta_pass;
     // for speeding up calculation
-    int _max_depth;
-    double *_sampling_table;
+    vector<double> _sampling_table;
+    vector<double> _parent_pw_path;
+    ContextCache *_context_cache;   // NULL unless enabled by `set_context_cache`
 
-    VPYLM() {
+    BasicVPYLM() {
+        SlabAllocator::Scope scope(&_allocator);
         _root = new Node(0);
         _root->_depth = 0;
         _beta_stop = VPYLM_BETA_STOP;
         _beta_pass = VPYLM_BETA_PASS;
-        _max_depth = 999;
-        _sampling_table = new double[_max_depth];
+        _context_cache = NULL;
     }
-    ~VPYLM() {
+    ~BasicVPYLM() {
         _delete_node(_root);
-        delete[] _sampling_table;
+        delete _context_cache;
+    }
+    // caches the context paths of scoring and generation in `num_entries` entries, or stops caching them if 0
+    void set_context_cache(int num_entries) {
+        delete _context_cache;
+        _context_cache = NULL;
+        if (num_entries > 0) {
+            _context_cache = new ContextCache(num_entries);
+        }
+    }
+    bool is_context_cache_enabled() const {
+        return _context_cache != NULL;
+    }
+    ContextCacheStats get_context_cache_stats() const {
+        return _context_cache == NULL ? ContextCacheStats() : _context_cache->get_stats();
+    }
+    void clear_context_cache_stats() {
+        if (_context_cache != NULL) {
+            _context_cache->clear_stats();
+        }
+    }
+    // to be called whenever counts or nodes change, as paths cached before would point to stale ones
+    void invalidate_context_cache() {
+        if (_context_cache != NULL) {
+            _context_cache->invalidate();
+        }
     }
     void _delete_node(Node *node) {
+        if (node == NULL) {
+            return;
+        }
         for (auto &elem : node->_children) {
             Node *child = elem.second;
             _delete_node(child);
         }
         delete node;
     }
-    bool add_customer_at_timestep(vector<id> &token_ids, int token_t_index, int depth_t) {
+    bool add_customer_at_timestep(vector<IdT> &token_ids, int token_t_index, int depth_t) {
+        return add_customer_at_timestep(token_ids, token_t_index, depth_t, _parent_pw_path);
+    }
+    // may run on several threads at once under a `NodeLockTable::Scope`, with `d_m` and `theta_m` sized in advance
+    bool add_customer_at_timestep(vector<IdT> &token_ids, int token_t_index, int depth_t, vector<double> &parent_pw_path) {
+        invalidate_context_cache();
+        SlabAllocator::Scope scope(&_allocator);
         Node *node = find_node_by_tracing_back_context(token_ids, token_t_index, depth_t, true);
-        id token_t = token_ids[token_t_index];
-        return node->add_customer(token_t, _g0, _d_m, _theta_m);
+        IdT token_t = token_ids[token_t_index];
+        // Pw of every ancestor is computed once and shared by all proxy customers
+        node->compute_parent_Pw_path(token_t, _g0, parent_pw_path, _d_m, _theta_m);
+        return node->add_customer(token_t, parent_pw_path, _d_m, _theta_m);
     }
-    bool remove_customer_at_timestep(vector<id> &token_ids, int token_t_index, int depth_t) {
+    // nodes left empty are kept while other threads may hold them or defer their updates of the root; see
+    // `remove_empty_nodes`
+    bool remove_customer_at_timestep(vector<IdT> &token_ids, int token_t_index, int depth_t) {
+        invalidate_context_cache();
+        SlabAllocator::Scope scope(&_allocator);
         Node *node = find_node_by_tracing_back_context(token_ids, token_t_index, depth_t, true);
-        id token_t = token_ids[token_t_index];
+        IdT token_t = token_ids[token_t_index];
         node->remove_customer(token_t);
-        if (node->need_to_remove_from_parent()) {
+        if (NodeLockTable::current() == NULL && Node::deferred_root_updates() == NULL && node->need_to_remove_from_parent()) {
             node->remove_from_parent();
         }
         return true;
     }
+    // deletes the nodes left empty by threads sharing the tree; call once they are done
+    void remove_empty_nodes() {
+        invalidate_context_cache();
+        SlabAllocator::Scope scope(&_allocator);
+        _remove_empty_nodes(_root);
+    }
+    void _remove_empty_nodes(Node *node) {
+        vector<IdT> empty_children;
+        for (auto &elem : node->_children) {
+            Node *child = elem.second;
+            _remove_empty_nodes(child);
+            if (child->_children.size() == 0 && child->_arrangement.size() == 0) {
+                empty_children.push_back(elem.first);
+            }
+        }
+        for (IdT token_id : empty_children) {
+            Node *child = node->_children.find(token_id)->second;
+            node->_children.erase(token_id);
+            delete child;
+        }
+    }
+    // seats and unseats the proxy customers and adds the pass counts threads deferred, see `Node::deferred_root_updates`
+    void apply_root_updates(typename Node::RootUpdates &updates) {
+        invalidate_context_cache();
+        SlabAllocator::Scope scope(&_allocator);
+        _root->_pass_count += updates.pass_count;
+        _parent_pw_path.assign(1, _g0);
+        for (auto &elem : updates.customers) {
+            if (elem.second > 0) {
+                _root->add_customer(elem.first, _parent_pw_path, _d_m, _theta_m, false);
+            } else {
+                _root->remove_customer(elem.first, false);
+            }
+        }
+        updates.clear();
+    }
+    // applies the pass counts kept back by this thread, see `Node::buffered_pass_counts`
+    void flush_buffered_pass_counts() {
+        pointer_hashmap<Node, int> *buffer = Node::buffered_pass_counts();
+        if (buffer == NULL || buffer->empty()) {
+            return;
+        }
+        invalidate_context_cache();
+        for (auto &elem : *buffer) {
+            NodeLock lock(elem.first);
+            elem.first->_pass_count += elem.second;
+        }
+        buffer->clear();
+        NodeLockTable::current_stats()->num_flushes++;
+    }
+    // Stolcke's relative entropy of the distribution of a leaf from that of its parent, weighted by the share of
+    // tokens whose context reaches it; words the leaf does not serve keep their proportions in the parent, so their
+    // part of the sum is a single scaled term
+    double compute_pruning_score(Node *leaf) {
+        Node *parent = leaf->_parent;
+        init_hyperparams_at_depth_if_needed(leaf->_depth);
+        double d_u = _d_m[leaf->_depth];
+        double theta_u = _theta_m[leaf->_depth];
+        double coeff = (theta_u + d_u * leaf->_num_tables) / (theta_u + leaf->_num_customers);
+        double entropy = 0;
+        double sum_parent_pw = 0;
+        for (auto &elem : leaf->_arrangement) {
+            double parent_pw = parent->compute_Pw(elem.first, _g0, _d_m, _theta_m);
+            double pw = leaf->compute_Pw_with_parent_Pw(elem.first, parent_pw, _d_m, _theta_m);
+            entropy += pw * log(pw / parent_pw);
+            sum_parent_pw += parent_pw;
+        }
+        entropy += coeff * std::max(0.0, 1.0 - sum_parent_pw) * log(coeff);
+        double num_tokens = _root->_stop_count + _root->_pass_count;
+        return (leaf->_stop_count + leaf->_pass_count) / std::max(1.0, num_tokens) * entropy;
+    }
+    // deletes a leaf after moving its customers into the parent, which then serves the contexts of the leaf
+    // the proxies of the leaf in the parent are replaced by its customers, and the tokens of the leaf stop at the parent
+    void fold_into_parent(Node *leaf) {
+        assert(leaf->_parent != NULL && leaf->_children.size() == 0);
+        invalidate_context_cache();
+        SlabAllocator::Scope scope(&_allocator);
+        Node *parent = leaf->_parent;
+        for (auto &elem : leaf->_arrangement) {
+            IdT token_id = elem.first;
+            for (int k=0; k<elem.second.num_tables(); ++k) {
+                parent->remove_customer(token_id, false);
+            }
+            for (int k=0; k<elem.second.num_customers(); ++k) {
+                parent->compute_parent_Pw_path(token_id, _g0, _parent_pw_path, _d_m, _theta_m);
+                parent->add_customer(token_id, _parent_pw_path, _d_m, _theta_m, false);
+            }
+        }
+        int num_tokens = leaf->_stop_count + leaf->_pass_count;
+        parent->_stop_count += num_tokens;
+        parent->_pass_count -= num_tokens;
+        parent->_children.erase(leaf->_token_id);
+        delete leaf;
+    }
+    // folds leaves of least `compute_pruning_score` into their parents until
+    // node_cost * get_num_nodes() + word_cost * get_num_words() <= max_cost; a parent left without children becomes
+    // a candidate in turn, and a leaf keeps the score it had when it became one; returns the number of removed nodes
+    int prune(double max_cost, double node_cost, double word_cost) {
+        int num_nodes = get_num_nodes();
+        int num_words = get_num_words();
+        vector<Node*> leaves;
+        _root->enumerate_leaves(leaves);
+        // ties are broken by the order of discovery, so that the result does not depend on addresses
+        using Candidate = pair<double, int>;
+        priority_queue<Candidate, vector<Candidate>, greater<Candidate>> candidates;
+        for (int k=0; k<leaves.size(); ++k) {
+            if (leaves[k] != _root) {
+                candidates.push(Candidate(compute_pruning_score(leaves[k]), k));
+            }
+        }
+        int num_removed = 0;
+        while (node_cost * num_nodes + word_cost * num_words > max_cost && candidates.empty() == false) {
+            Node *leaf = leaves[candidates.top().second];
+            candidates.pop();
+            Node *parent = leaf->_parent;
+            num_nodes--;
+            num_words -= leaf->_arrangement.size();
+            fold_into_parent(leaf);
+            num_removed++;
+            if (parent != _root && parent->_children.size() == 0) {
+                leaves.push_back(parent);
+                candidates.push(Candidate(compute_pruning_score(parent), leaves.size() - 1));
+            }
+        }
+        return num_removed;
+    }
     // tracing back from `t` by `order_t`
     // token_ids:           [0, 1, 2, 3, 4, 5]
     // token_t_index: 4            ^     ^
     // order_t: 2                  |<- <-|
-    Node *find_node_by_tracing_back_context(vector<id> &token_ids, int token_t_index, int order_t, bool generate_node_if_needed=false, bool return_middle_node=false) {
+    Node *find_node_by_tracing_back_context(vector<IdT> &token_ids, int token_t_index, int order_t, bool generate_node_if_needed=false, bool return_middle_node=false) {
         if (token_t_index - order_t < 0) {
             return NULL;
         }
+        SlabAllocator::Scope scope(&_allocator);
         Node *node = _root;
         for (int depth=1; depth<=order_t; ++depth) {
-            id context_token_id = token_ids[token_t_index - depth];
+            IdT context_token_id = token_ids[token_t_index - depth];
             Node *child = node->find_child_node(context_token_id, generate_node_if_needed);
             if (child == NULL) {
                 if (return_middle_node) {
@@ -87,91 +276,198 @@ public:
         }
         return node;
     }
-    int sample_depth_at_timestep(vector<id> &context_token_ids, int token_t_index) {
+    // nodes from the root to the one of the customer at `depth_t`, which must exist
+    void find_path_of_customer(vector<IdT> &token_ids, int token_t_index, int depth_t, vector<Node*> &path) {
+        Node *node = find_node_by_tracing_back_context(token_ids, token_t_index, depth_t);
+        assert(node != NULL);
+        path.resize(depth_t + 1);
+        for (int depth=depth_t; depth>=0; --depth) {
+            path[depth] = node;
+            node = node->_parent;
+        }
+    }
+    int sample_depth_at_timestep(vector<IdT> &context_token_ids, int token_t_index) {
+        return sample_depth_at_timestep(context_token_ids, token_t_index, _sampling_table, NULL, NULL);
+    }
+    // thread-safe as long as the tree is not modified or while its nodes are locked, see `NodeLockTable`
+    // `path` receives the visited nodes from the root
+    // counts of `delta` are added to those of the tree, see `BasicTreeDelta`
+    int sample_depth_at_timestep(vector<IdT> &context_token_ids, int token_t_index, vector<double> &sampling_table, vector<Node*> *path, const TreeDelta *delta) {
         if (token_t_index == 0) {
             return 0;
         }
-        id token_t = context_token_ids[token_t_index];
+        IdT token_t = context_token_ids[token_t_index];
         // censoring if stop prob below this value
         double eps = 1e-24;
         double sum = 0;
         double p_pass = 1;
-        double pw = 0;
-        int sampling_table_size = 0;
+        // descend from root once, carrying Pw of the parent node
+        double parent_pw = _g0;
+        sampling_table.clear();
+        if (path) {
+            path->clear();
+        }
         Node *node = _root;
-        for (int n=0; n<=token_t_index; ++n) {
-            if (node) {
-                pw = node->compute_Pw(token_t, _g0, _d_m, _theta_m);
-                double p_stop = node->stop_probability(_beta_stop, _beta_pass, false) * p_pass;
-                double p = pw * p_stop;
-                p_pass *= node->pass_probability(_beta_stop, _beta_pass, false);
-                _sampling_table[n] = p;
-                sampling_table_size += 1;
-                sum += p;
-                if (p_stop < eps) {
-                    break;
-                }
-                if (n < token_t_index) {
-                    id context_token_id = context_token_ids[token_t_index - n - 1];
-                    node = node->find_child_node(context_token_id);
-                }
+        for (int n=0; n<=token_t_index && node != NULL; ++n) {
+            double pw, p_stop_u, p_pass_u;
+            if (delta == NULL) {
+                NodeLock lock(node);
+                pw = node->compute_Pw_with_parent_Pw(token_t, parent_pw, _d_m, _theta_m);
+                p_stop_u = node->stop_probability(_beta_stop, _beta_pass, false);
+                p_pass_u = node->pass_probability(_beta_stop, _beta_pass, false);
             } else {
-                double p_stop = p_pass * _beta_stop / (_beta_stop + _beta_pass);
-                double p = pw * p_stop;
-                _sampling_table[n] = p;
-                sampling_table_size += 1;
-                sum += p;
-                p_pass *= _beta_pass / (_beta_stop + _beta_pass);
-                if (p_stop < eps) {
-                    break;
-                }
+                delta->compute_probabilities(node, token_t, parent_pw, _d_m, _theta_m, _beta_stop, _beta_pass, pw, p_stop_u, p_pass_u);
             }
+            if (path) {
+                path->push_back(node);
+            }
+            double p_stop = p_stop_u * p_pass;
+            double p = pw * p_stop;
+            p_pass *= p_pass_u;
+            sampling_table.push_back(p);
+            sum += p;
+            parent_pw = pw;
+            if (p_stop < eps) {
+                p_pass = 0;
+                break;
+            }
+            if (n < token_t_index) {
+                IdT context_token_id = context_token_ids[token_t_index - n - 1];
+                node = node->find_child_node(context_token_id);
+            }
+        }
+        // beyond the tree Pw stays that of the deepest existing node and the stop probabilities form a geometric series
+        // p_stop of the k-th depth past the tree is p_pass * r_stop * r_pass^k
+        int tree_size = sampling_table.size();
+        int tail_size = token_t_index + 1 - tree_size;
+        double r_pass = _beta_pass / (_beta_stop + _beta_pass);
+        double tail_mass = 0;
+        if (tail_size > 0 && p_pass > 0) {
+            tail_mass = parent_pw * p_pass * (1.0 - pow(r_pass, tail_size));
         }
-        double normalizer = 1.0 / sum;
-        double bernoulli = sampler::uniform(0, 1);
+        double bernoulli = sampler::uniform(0, 1) * (sum + tail_mass);
         double stack = 0;
-        for (int n=0; n<sampling_table_size; ++n) {
-            stack += _sampling_table[n] * normalizer;
+        for (int n=0; n<tree_size; ++n) {
+            stack += sampling_table[n];
             if (bernoulli < stack) {
                 return n;
             }
         }
-        return _sampling_table[sampling_table_size - 1];
+        if (tail_mass <= 0) {
+            return tree_size - 1;
+        }
+        // inverse CDF of the truncated geometric distribution
+        double u = std::min(1.0, (bernoulli - sum) / (parent_pw * p_pass));
+        int k = 0;
+        if (r_pass > 0 && u > 0) {
+            k = (int)(log1p(-u) / log(r_pass));
+        }
+        return tree_size + std::min(std::max(k, 0), tail_size - 1);
+    }
+    double compute_Pw_given_h(IdT token_id, vector<IdT> &context_token_ids) {
+        return compute_Pw_given_context(token_id, BasicContextView<IdT>(context_token_ids));
     }
-    double compute_Pw_given_h(id token_id, vector<id> &context_token_ids) {
+    // `context` is read by `size()` and `recent(n)`, see `BasicScoringState`
+    template<typename ContextT>
+    double compute_Pw_given_context(IdT token_id, const ContextT &context) {
+        ContextPath path;
+        if (_context_cache != NULL && find_context_path(context, path)) {
+            double parent_pw = _g0;
+            double pw_h = 0;
+            for (int n=0; n<path.num_nodes; ++n) {
+                double pw = path.nodes[n]->compute_Pw_with_parent_Pw(token_id, parent_pw, _d_m, _theta_m);
+                pw_h += pw * path.p_stops[n];
+                parent_pw = pw;
+            }
+            // p_pass is 0 if the walk was censored
+            pw_h += parent_pw * path.p_pass;
+            return pw_h;
+        }
         Node *node = _root;
         // censoring if stop prob below this value
         double eps = 1e-24;
         double parent_pw = _g0;
         double p_pass = 1;
-        double p_stop = 1;
         double pw_h = 0;
         // position of token_id is depth 0
         int depth = 0;
-        while (p_stop > eps) {
-            // if context node does not exit
-            if (node == NULL) {
-                p_stop = p_pass * _beta_stop / (_beta_stop + _beta_pass);
-                pw_h += parent_pw * p_stop;
-                p_pass *= _beta_pass / (_beta_stop + _beta_pass);
+        while (node != NULL) {
+            double pw = node->compute_Pw_with_parent_Pw(token_id, parent_pw, _d_m, _theta_m);
+            double p_stop = node->stop_probability(_beta_stop, _beta_pass, false) * p_pass;
+            p_pass *= node->pass_probability(_beta_stop, _beta_pass, false);
+            pw_h += pw * p_stop;
+            parent_pw = pw;
+            if (p_stop <= eps) {
+                return pw_h;
+            }
+            if (depth < context.size()) {
+                node = node->find_child_node(context.recent(depth));
             } else {
-                double pw = node->compute_Pw_with_parent_Pw(token_id, parent_pw, _d_m, _theta_m);
-                p_stop = node->stop_probability(_beta_stop, _beta_pass, false) * p_pass;
-                p_pass *= node->pass_probability(_beta_stop, _beta_pass, false);
-                pw_h += pw * p_stop;
-                parent_pw = pw;
-                if (depth < context_token_ids.size()) {
-                    id context_token_id = context_token_ids[context_token_ids.size() - depth - 1];
-                    node = node->find_child_node(context_token_id);
-                } else {
-                    node = NULL;
+                if (context.is_truncated() && node->_children.size() > 0) {
+                    throw ScoringStateTooShort();
                 }
+                node = NULL;
             }
             depth++;
         }
+        // beyond the tree: sum_k p_pass * r_stop * r_pass^k = p_pass, all with Pw of the deepest node
+        pw_h += parent_pw * p_pass;
         return pw_h;
     }
-    double compute_Pn_given_h(int n, vector<id> &context_token_ids) {
+    // walks the nodes of `context` as `compute_Pw_given_context` does; false if the walk reads more than the last
+    // VPYLM_CONTEXT_CACHE_ORDER tokens, which a cache entry keeps
+    template<typename ContextT>
+    bool trace_context_path(const ContextT &context, ContextPath &path) {
+        // censoring if stop prob below this value
+        double eps = 1e-24;
+        double p_pass = 1;
+        path.num_nodes = 0;
+        Node *node = _root;
+        int depth = 0;
+        while (node != NULL) {
+            double p_stop = node->stop_probability(_beta_stop, _beta_pass, false) * p_pass;
+            p_pass *= node->pass_probability(_beta_stop, _beta_pass, false);
+            path.nodes[path.num_nodes] = node;
+            path.p_stops[path.num_nodes] = p_stop;
+            path.num_nodes++;
+            if (p_stop <= eps) {
+                p_pass = 0;
+                break;
+            }
+            if (depth < context.size()) {
+                if (depth >= VPYLM_CONTEXT_CACHE_ORDER) {
+                    return false;
+                }
+                node = node->find_child_node(context.recent(depth));
+            } else {
+                node = NULL;
+            }
+            depth++;
+        }
+        path.p_pass = p_pass;
+        return true;
+    }
+    // path of `context` from the cache, traced and cached on a miss; false if it cannot be cached
+    template<typename ContextT>
+    bool find_context_path(const ContextT &context, ContextPath &path) {
+        if (_context_cache->find(context, path)) {
+            return true;
+        }
+        uint64_t epoch = _context_cache->get_epoch();
+        if (trace_context_path(context, path) == false) {
+            return false;
+        }
+        _context_cache->insert(context, path, epoch);
+        return true;
+    }
+    // log Pw of `token_id` after the context of `state`, which `next_state` receives extended by `token_id`
+    // `next_state` may be `state`; each call walks at most one path of the tree and allocates nothing
+    double score(const ScoringState &state, IdT token_id, ScoringState &next_state) {
+        double pw_h = compute_Pw_given_context(token_id, state);
+        next_state.extend(state, token_id);
+        return log(pw_h);
+    }
+    double compute_Pn_given_h(int n, vector<IdT> &context_token_ids) {
         Node *node = _root;
         double p_stop, p_pass;
         for (int depth=0; depth<=n; ++depth) {
@@ -182,7 +478,7 @@ public:
                 p_stop = node->stop_probability(_beta_stop, _beta_pass);
                 p_pass = node->pass_probability(_beta_stop, _beta_pass);
                 if (depth < context_token_ids.size()) {
-                    id context_token_id = context_token_ids[context_token_ids.size() - depth - 1];
+                    IdT context_token_id = context_token_ids[context_token_ids.size() - depth - 1];
                     node = node->find_child_node(context_token_id);
                 } else {
                     node = NULL;
@@ -191,74 +487,193 @@ public:
         }
         return p_stop;
     }
-    double compute_Pw(vector<id> &token_ids) {
+    double compute_Pw(vector<IdT> &token_ids) {
         if (token_ids.size() == 0) {
             return 0;
         }
         double mult_pw = 1;
-        vector<id> context_token_ids(token_ids.begin(), token_ids.begin() + 1);
+        vector<IdT> context_token_ids(token_ids.begin(), token_ids.begin() + 1);
         for (int t=1; t<token_ids.size(); ++t) {
-            id token_id = token_ids[t];
+            IdT token_id = token_ids[t];
             double pw_h = compute_Pw_given_h(token_id, context_token_ids);
             mult_pw *= pw_h;
             context_token_ids.push_back(token_ids[t]);
         }
         return mult_pw;
     }
-    id sample_next_token(vector<id> &context_token_ids, unordered_set<id> &all_token_ids) {
-        vector<id> word_ids;
-        vector<double> probs;
-        double sum = 0;
-        for (id token_id : all_token_ids) {
-            if (token_id == ID_BOS) {
-                continue;
+    // weights of the nodes on the context path for the next-token distribution
+    // with Pw_n = first_n(w) + coeff_n * Pw_{n-1} and stop probabilities p_n,
+    // sum_n p_n * Pw_n = sum_n W_n * first_n(w) + W_0 * coeff_0 * g0, where W_n = p_n + coeff_{n+1} * W_{n+1}
+    // fills `nodes` and `weights` (W_n) and returns W_0 * coeff_0 * g0, the probability shared by every word
+    double compute_path_weights(vector<IdT> &context_token_ids, vector<Node*> &nodes, vector<double> &weights) {
+        // censoring if stop prob below this value
+        double eps = 1e-24;
+        nodes.clear();
+        weights.clear();
+        double p_pass = 1;
+        ContextPath path;
+        if (_context_cache != NULL && find_context_path(BasicContextView<IdT>(context_token_ids), path)) {
+            for (int n=0; n<path.num_nodes; ++n) {
+                Node *node = path.nodes[n];
+                node->init_hyperparams_at_depth_if_needed(node->_depth, _d_m, _theta_m);
+                nodes.push_back(node);
+                weights.push_back(path.p_stops[n]);
             }
-            double pw_h = compute_Pw_given_h(token_id, context_token_ids);
-            if (pw_h > 0) {
-                word_ids.push_back(token_id);
-                probs.push_back(pw_h);
-                sum += pw_h;
+            p_pass = path.p_pass;
+        } else {
+            Node *node = _root;
+            int depth = 0;
+            while (node != NULL) {
+                node->init_hyperparams_at_depth_if_needed(node->_depth, _d_m, _theta_m);
+                double p_stop = node->stop_probability(_beta_stop, _beta_pass, false) * p_pass;
+                p_pass *= node->pass_probability(_beta_stop, _beta_pass, false);
+                nodes.push_back(node);
+                weights.push_back(p_stop);
+                if (p_stop <= eps) {
+                    p_pass = 0;
+                    break;
+                }
+                if (depth < context_token_ids.size()) {
+                    IdT context_token_id = context_token_ids[context_token_ids.size() - depth - 1];
+                    node = node->find_child_node(context_token_id);
+                } else {
+                    node = NULL;
+                }
+                depth++;
             }
         }
-        if (word_ids.size() == 0) {
-            return ID_EOS;
+        // beyond the tree every depth shares Pw of the deepest node
+        weights.back() += p_pass;
+        double coeff = 0;
+        for (int n=nodes.size()-1; n>=0; --n) {
+            if (n < nodes.size() - 1) {
+                weights[n] += coeff * weights[n + 1];
+            }
+            Node *node = nodes[n];
+            double d_u = _d_m[node->_depth];
+            double theta_u = _theta_m[node->_depth];
+            coeff = (theta_u + d_u * node->_num_tables) / (theta_u + node->_num_customers);
         }
-        if (sum == 0) {
+        return weights[0] * coeff * _g0;
+    }
+    // next-token distribution for every word at once by walking the context path a single time
+    // Pw_h(w) = base + sparse_Pw[w], where only words seated along the path appear in `sparse_Pw`; returns base
+    double compute_Pw_given_h_for_all_words(vector<IdT> &context_token_ids, hashmap<IdT, double> &sparse_Pw) {
+        vector<Node*> nodes;
+        vector<double> weights;
+        double base = compute_path_weights(context_token_ids, nodes, weights);
+        sparse_Pw.clear();
+        for (int n=0; n<nodes.size(); ++n) {
+            Node *node = nodes[n];
+            double d_u = _d_m[node->_depth];
+            double theta_u = _theta_m[node->_depth];
+            double c_u = node->_num_customers;
+            for (auto &elem : node->_arrangement) {
+                const table_record &tables = elem.second;
+                double first_term = std::max(0.0, tables.num_customers() - d_u * tables.num_tables()) / (theta_u + c_u);
+                sparse_Pw[elem.first] += weights[n] * first_term;
+            }
+        }
+        return base;
+    }
+    // Pw_h is a mixture of `base` over the vocabulary and, for each node on the path, of the discounted counts
+    // with mass W_n * (c_u - d_u * t_u) / (theta_u + c_u); pick a component first, then a word inside it
+    IdT sample_next_token(vector<IdT> &context_token_ids, int num_token_ids) {
+        vector<Node*> nodes;
+        vector<double> weights;
+        double base = compute_path_weights(context_token_ids, nodes, weights);
+        int num_words = num_token_ids - 1;     // every id but ID_BOS
+        vector<double> masses(nodes.size());
+        double sum = base * num_words;
+        for (int n=0; n<nodes.size(); ++n) {
+            Node *node = nodes[n];
+            double d_u = _d_m[node->_depth];
+            double theta_u = _theta_m[node->_depth];
+            masses[n] = weights[n] * std::max(0.0, node->_num_customers - d_u * node->_num_tables) / (theta_u + node->_num_customers);
+            sum += masses[n];
+        }
+        if (num_words == 0 || sum <= 0) {
             return ID_EOS;
         }
-        double normalizer = 1.0 / sum;
-        double bernoulli = sampler::uniform(0, 1);
-        double stack = 0;
-        for (int i=0; i<word_ids.size(); ++i) {
-            stack += probs[i] * normalizer;
-            if (stack >= bernoulli) {
-                return word_ids[i];
+        double bernoulli = sampler::uniform(0, 1) * sum;
+        for (int n=0; n<nodes.size(); ++n) {
+            if (bernoulli >= masses[n]) {
+                bernoulli -= masses[n];
+                continue;
+            }
+            Node *node = nodes[n];
+            double d_u = _d_m[node->_depth];
+            double normalizer = weights[n] / (_theta_m[node->_depth] + node->_num_customers);
+            double stack = 0;
+            IdT last_token_id = ID_EOS;
+            for (auto &elem : node->_arrangement) {
+                const table_record &tables = elem.second;
+                stack += std::max(0.0, tables.num_customers() - d_u * tables.num_tables()) * normalizer;
+                last_token_id = elem.first;
+                if (stack >= bernoulli) {
+                    return elem.first;
+                }
             }
+            return last_token_id;
         }
-        return word_ids.back();
+        // every word has mass `base` here; ids are dense and ID_BOS is 0
+        bernoulli -= base * num_words;
+        int word_index = std::min<int>(std::max(0.0, bernoulli / base), num_words - 1);
+        return word_index + 1;
     }
-    double compute_log_Pw(vector<id> &token_ids) {
+    // `k` most probable next tokens in descending order of Pw_h
+    void get_top_k_next_tokens(vector<IdT> &context_token_ids, int k, int num_token_ids, vector<pair<IdT, double>> &top_k) {
+        // a negative `k` would compare as a huge size below
+        k = std::max(k, 0);
+        hashmap<IdT, double> sparse_Pw;
+        double base = compute_Pw_given_h_for_all_words(context_token_ids, sparse_Pw);
+        top_k.clear();
+        for (auto &elem : sparse_Pw) {
+            if (elem.first != ID_BOS && elem.first < num_token_ids) {
+                top_k.push_back(std::make_pair(elem.first, base + elem.second));
+            }
+        }
+        auto by_prob = [](const pair<IdT, double> &a, const pair<IdT, double> &b) {
+            return a.second > b.second;
+        };
+        if (top_k.size() > k) {
+            std::partial_sort(top_k.begin(), top_k.begin() + k, top_k.end(), by_prob);
+            top_k.resize(k);
+            return;
+        }
+        std::sort(top_k.begin(), top_k.end(), by_prob);
+        // the rest of vocabulary ties at `base`
+        for (IdT token_id=0; token_id<num_token_ids; ++token_id) {
+            if (top_k.size() >= k) {
+                break;
+            }
+            if (token_id != ID_BOS && sparse_Pw.count(token_id) == 0) {
+                top_k.push_back(std::make_pair(token_id, base));
+            }
+        }
+    }
+    double compute_log_Pw(vector<IdT> &token_ids) {
         if (token_ids.size() == 0) {
             return 0;
         }
         double sum_pw_h = 0;
-        vector<id> context_token_ids(token_ids.begin(), token_ids.begin() + 1);
+        vector<IdT> context_token_ids(token_ids.begin(), token_ids.begin() + 1);
         for (int t=1; t<token_ids.size(); ++t) {
-            id token_id = token_ids[t];
+            IdT token_id = token_ids[t];
             double pw_h = compute_Pw_given_h(token_id, context_token_ids);
             sum_pw_h += log(pw_h);
             context_token_ids.push_back(token_id);
         }
         return sum_pw_h;
     }
-    double compute_log2_Pw(vector<id> &token_ids) {
+    double compute_log2_Pw(vector<IdT> &token_ids) {
         if (token_ids.size() == 0) {
             return 0;
         }
         double sum_pw_h = 0;
-        vector<id> context_token_ids(token_ids.begin(), token_ids.begin() + 1);
+        vector<IdT> context_token_ids(token_ids.begin(), token_ids.begin() + 1);
         for (int t=1; t<token_ids.size(); ++t) {
-            id token_id = token_ids[t];
+            IdT token_id = token_ids[t];
             double pw_h = compute_Pw_given_h(token_id, context_token_ids);
             sum_pw_h += log2(pw_h);
             context_token_ids.push_back(token_id);
@@ -297,43 +712,92 @@ public:
             }
         }
     }
-    void sum_auxiliary_variables_recursively(Node *node, vector<double> &sum_log_x_u_m, vector<double> &sum_y_ui_m, vector<double> &sum_1_y_ui_m, vector<double> &sum_1_z_uwkj_m) {
+    // per-depth sums of the auxiliary variables
+    struct AuxiliarySums {
+        vector<double> sum_log_x_u_m;
+        vector<double> sum_y_ui_m;
+        vector<double> sum_1_y_ui_m;
+        vector<double> sum_1_z_uwkj_m;
+
+        AuxiliarySums(int max_depth) : sum_log_x_u_m(max_depth + 1, 0.0), sum_y_ui_m(max_depth + 1, 0.0),
+                                       sum_1_y_ui_m(max_depth + 1, 0.0), sum_1_z_uwkj_m(max_depth + 1, 0.0) {}
+        void add(const AuxiliarySums &other) {
+            for (int u=0; u<sum_log_x_u_m.size(); ++u) {
+                sum_log_x_u_m[u] += other.sum_log_x_u_m[u];
+                sum_y_ui_m[u] += other.sum_y_ui_m[u];
+                sum_1_y_ui_m[u] += other.sum_1_y_ui_m[u];
+                sum_1_z_uwkj_m[u] += other.sum_1_z_uwkj_m[u];
+            }
+        }
+    };
+    void sum_auxiliary_variables(Node *node, AuxiliarySums &sums) {
+        int depth = node->_depth;
+        double d = _d_m[depth];
+        double theta = _theta_m[depth];
+        sums.sum_log_x_u_m[depth] += node->auxiliary_log_x_u(theta);    // log(x_u)
+        double sum_y_ui, sum_1_y_ui;
+        node->auxiliary_y_ui(d, theta, sum_y_ui, sum_1_y_ui);
+        sums.sum_y_ui_m[depth] += sum_y_ui;                             // y_ui
+        sums.sum_1_y_ui_m[depth] += sum_1_y_ui;                         // 1 - y_ui
+        sums.sum_1_z_uwkj_m[depth] += node->auxiliary_1_z_uwkj(d);      // 1 - z_uwkj
+    }
+    void sum_auxiliary_variables_recursively(Node *node, AuxiliarySums &sums) {
+        sum_auxiliary_variables(node, sums);
         for (auto elem : node->_children) {
             Node *child = elem.second;
-            int depth = child->_depth;
-            double d = _d_m[depth];
-            double theta = _theta_m[depth];
-            sum_log_x_u_m[depth] += child->auxiliary_log_x_u(theta);    // log(x_u)
-            sum_y_ui_m[depth] += child->auxiliary_y_ui(d, theta);       // y_ui
-            sum_1_y_ui_m[depth] += child->auxiliary_1_y_ui(d, theta);   // 1 - y_ui
-            sum_1_z_uwkj_m[depth] += child->auxiliary_1_z_uwkj(d);      // 1 - z_uwkj
-            sum_auxiliary_variables_recursively(child, sum_log_x_u_m, sum_y_ui_m, sum_1_y_ui_m, sum_1_z_uwkj_m);
+            sum_auxiliary_variables_recursively(child, sums);
         }
     }
     // estimating `d` and `theta`
-    void sample_hyperparams() {
+    // subtrees of the root are visited in chunks of VPYLM_HYPERPARAMS_CHUNK_SIZE, in parallel if `pool` is given
+    // every chunk draws from its own stream seeded by `sampler::rng` and its index, and the sums are reduced in order
+    // of the chunks, so the result depends on the seed only and not on the number of threads
+    void sample_hyperparams(ThreadPool *pool=NULL) {
         int max_depth = get_depth();
-        vector<double> sum_log_x_u_m(max_depth + 1, 0.0);
-        vector<double> sum_y_ui_m(max_depth + 1, 0.0);
-        vector<double> sum_1_y_ui_m(max_depth + 1, 0.0);
-        vector<double> sum_1_z_uwkj_m(max_depth + 1, 0.0);
+        init_hyperparams_at_depth_if_needed(max_depth);
         // root
-        sum_log_x_u_m[0] = _root->auxiliary_log_x_u(_theta_m[0]);
-        sum_y_ui_m[0] = _root->auxiliary_y_ui(_d_m[0], _theta_m[0]);
-        sum_1_y_ui_m[0] = _root->auxiliary_1_y_ui(_d_m[0], _theta_m[0]);
-        sum_1_z_uwkj_m[0] = _root->auxiliary_1_z_uwkj(_d_m[0]);
+        AuxiliarySums sums(max_depth);
+        sum_auxiliary_variables(_root, sums);
         // others
-        init_hyperparams_at_depth_if_needed(max_depth);
-        sum_auxiliary_variables_recursively(_root, sum_log_x_u_m, sum_y_ui_m, sum_1_y_ui_m, sum_1_z_uwkj_m);
+        vector<pair<IdT, Node*>> subtrees;
+        for (auto &elem : _root->_children) {
+            subtrees.push_back(elem);
+        }
+        std::sort(subtrees.begin(), subtrees.end());
+        int num_chunks = (subtrees.size() + VPYLM_HYPERPARAMS_CHUNK_SIZE - 1) / VPYLM_HYPERPARAMS_CHUNK_SIZE;
+        vector<AuxiliarySums> chunk_sums(num_chunks, AuxiliarySums(max_depth));
+        uint64_t seed = sampler::rng();
+        std::atomic<int> next_chunk(0);
+        auto sum_chunks = [&](int worker) {
+            for (int chunk=next_chunk++; chunk<num_chunks; chunk=next_chunk++) {
+                sampler::engine engine = sampler::make_engine(seed, chunk);
+                sampler::EngineScope engine_scope(&engine);
+                int end = std::min<int>((chunk + 1) * VPYLM_HYPERPARAMS_CHUNK_SIZE, subtrees.size());
+                for (int i=chunk*VPYLM_HYPERPARAMS_CHUNK_SIZE; i<end; ++i) {
+                    sum_auxiliary_variables_recursively(subtrees[i].second, chunk_sums[chunk]);
+                }
+            }
+        };
+        if (pool == NULL) {
+            sum_chunks(0);
+        } else {
+            pool->run(sum_chunks);
+        }
+        for (auto &elem : chunk_sums) {
+            sums.add(elem);
+        }
         for (int u=0; u<=max_depth; ++u) {
-            _d_m[u] = sampler::beta(_a_m[u] + sum_1_y_ui_m[u], _b_m[u] + sum_1_z_uwkj_m[u]);
-            _theta_m[u] = sampler::gamma(_alpha_m[u] + sum_y_ui_m[u], _beta_m[u] - sum_log_x_u_m[u]);
-
+            _d_m[u] = sampler::beta(_a_m[u] + sums.sum_1_y_ui_m[u], _b_m[u] + sums.sum_1_z_uwkj_m[u]);
+            _theta_m[u] = sampler::gamma(_alpha_m[u] + sums.sum_y_ui_m[u], _beta_m[u] - sums.sum_log_x_u_m[u]);
         }
     }
     int get_num_nodes() {
         return _root->get_num_nodes();
     }
+    // entries of all arrangements
+    int get_num_words() {
+        return _root->get_num_words();
+    }
     int get_num_customers() {
         return _root->get_num_customers();
     }
@@ -355,6 +819,9 @@ public:
             update_max_depth(child, max_depth);
         }
     }
+    size_t get_num_bytes_reserved() {
+        return _allocator.get_num_bytes_reserved();
+    }
     int get_depth() {
         int max_depth = 0;
         update_max_depth(_root, max_depth);
@@ -363,11 +830,11 @@ public:
     void count_tokens_of_each_depth(unordered_map<int, int> &map) {
         _root->count_tokens_of_each_depth(map);
     }
-    void enumerate_phrases_at_depth(int depth, vector<vector<id>> &phrases) {
+    void enumerate_phrases_at_depth(int depth, vector<vector<IdT>> &phrases) {
         vector<Node*> nodes;
         _root->enumerate_nodes_at_depth(depth, nodes);
         for (auto &node : nodes) {
-            vector<id> phrase;
+            vector<IdT> phrase;
             while (node->_parent) {
                 phrase.push_back(node->_token_id);
                 node = node->_parent;
@@ -378,6 +845,16 @@ public:
     template <class Archive>
     void serialize(Archive& archive, unsigned int version)
     {
+        if (version >= 1) {
+            // widths of the layout; table counts are stored as int and load into any count type
+            int id_bytes = sizeof(IdT);
+            int count_bytes = sizeof(CountT);
+            archive & id_bytes;
+            archive & count_bytes;
+            if (id_bytes != sizeof(IdT)) {
+                throw std::runtime_error("the model file was saved with " + std::to_string(id_bytes) + "-byte token ids");
+            }
+        }
         archive & _root;
         archive & _g0;
         archive & _beta_stop;
@@ -395,13 +872,35 @@ public:
         oarchive << *this;
         return true;
     }
-    bool load(string filename = "hpylm.model"){
+    // `loaded_token_ids` maps token ids of the file to those of the vocabulary, see `Vocab::get_loaded_token_ids`
+    bool load(string filename = "hpylm.model", unordered_map<uint64_t, id> *loaded_token_ids = NULL){
         std::ifstream ifs(filename);
         if(ifs.good() == false){
             return false;
         }
-        boost::archive::binary_iarchive iarchive(ifs);
-        iarchive >> *this;
+        invalidate_context_cache();
+        SlabAllocator::Scope scope(&_allocator);
+        _delete_node(_root);
+        _root = NULL;
+        Node::loaded_token_ids() = loaded_token_ids;
+        try {
+            boost::archive::binary_iarchive iarchive(ifs);
+            iarchive >> *this;
+        } catch (...) {
+            Node::loaded_token_ids() = NULL;
+            throw;
+        }
+        Node::loaded_token_ids() = NULL;
         return true;
     }
-};
\ No newline at end of file
+};
+namespace boost { namespace serialization {
+template<typename IdT, typename CountT>
+struct version<BasicVPYLM<IdT, CountT>> {
+    typedef mpl::int_<1> type;
+    typedef mpl::integral_c_tag tag;
+    BOOST_STATIC_CONSTANT(int, value = version::type::value);
+};
+}}
+
+using VPYLM = BasicVPYLM<id, table_count>;
@@ -17,7 +17,10 @@ def train(args):
 
     # set base distribution
     vpylm.set_g0(1.0/float(vpylm.get_num_types_of_words()))
+    vpylm.set_num_chains(args.chains)
     vpylm.prepare()
+    vpylm.set_num_threads(args.threads)
+    vpylm.set_hogwild(args.hogwild)
 
     # training
     for epoch in range(1, args.epoch+1):
@@ -36,4 +39,7 @@ if __name__ == '__main__':
     parser.add_argument("-e", "--epoch", type=int, default=10000)
     parser.add_argument("-m", "--model", default="./model")
     parser.add_argument("-r", "--split_ratio", type=float, default=0.8)
+    parser.add_argument("-t", "--threads", type=int, default=1)
+    parser.add_argument("--hogwild", action="store_true")
+    parser.add_argument("-c", "--chains", type=int, default=1)
     train(parser.parse_args())
\ No newline at end of file